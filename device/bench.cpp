@@ -0,0 +1,220 @@
+/*
+ * File:   bench.cpp
+ * Author: Ed Alegrid
+ *
+ * Load generator and latency benchmark for the C++ TCP edge connector.
+ * Every connection is a Tcp::Client on its own thread sending a mix of node-edge-read and
+ * node-edge-write requests, closed loop (next request when the reply arrives) or at a fixed rate.
+ *
+ * $ g++ -Wall -O2 bench.cpp -o bin/bench -std=c++20 -pthread
+ * $ ./bin/bench --conns 8 --requests 200000 --writes 20
+ * $ ./bin/bench --conns 8 --rate 20000 --seconds 10
+ * $ ./bin/bench --micro 1000000
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+#include "lib/client.h"
+#include "routes.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// heap allocations, --micro reports them per request
+// gcc takes the malloc() in operator new for a mismatch with the free() in operator delete
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+static atomic<long> allocations{0};
+
+void *operator new(size_t n)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void *p = malloc(n ? n : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Options
+{
+    string ip = "127.0.0.1";
+    int port = 5300;
+    int conns = 4;
+    long requests = 100000;     // closed loop total, ignored when seconds is set
+    double seconds = 0;         // run for a fixed time instead of a request count
+    double rate = 0;            // requests per second over all connections, 0 is closed loop
+    int writes = 0;             // percentage of node-edge-write requests
+    long micro = 0;             // iterations of the in-process parse, dispatch and serialize benchmark
+};
+
+const string readMsg = R"({"topic":"random-data", "method":"node-edge-read", "payload":"", "value":""})";
+const string writeMsg = R"({"topic":"name-data", "method":"node-edge-write", "payload":"bench", "value":""})";
+
+struct Result
+{
+    vector<uint32_t> latency;   // ns, capped at ~4 s
+    long errors = 0;
+};
+
+void usage()
+{
+    cout << "usage: ./bin/bench [--ip 127.0.0.1] [--port 5300] [--conns 4] [--requests 100000 | --seconds s]\n"
+            "                   [--rate req/s] [--writes percent] [--micro iterations]" << endl;
+    exit(1);
+}
+
+Options parse(int argc, char *argv[])
+{
+    Options o;
+    for (int k = 1; k < argc; k++) {
+        string a = argv[k];
+        if (k + 1 >= argc) {
+            usage();
+        }
+        string v = argv[++k];
+        if (a == "--ip") o.ip = v;
+        else if (a == "--port") o.port = stoi(v);
+        else if (a == "--conns") o.conns = max(1, stoi(v));
+        else if (a == "--requests") o.requests = stol(v);
+        else if (a == "--seconds") o.seconds = stod(v);
+        else if (a == "--rate") o.rate = stod(v);
+        else if (a == "--writes") o.writes = clamp(stoi(v), 0, 100);
+        else if (a == "--micro") o.micro = stol(v);
+        else usage();
+    }
+    return o;
+}
+
+// one connection, in fixed rate mode latency is taken from the time the request was due
+// so a stalled server is not hidden by requests that were sent late (coordinated omission)
+void worker(const Options &o, int id, Clock::time_point start, Clock::time_point stop, atomic<long> &budget, Result &res)
+{
+    Tcp::Client c;
+    c.setConnectTimeout(2000);
+    c.serverConnect(o.port, o.ip);
+    c.setReadTimeout(2000);
+
+    mt19937 rng(id);
+    uniform_int_distribution<int> pct(0, 99);
+    double interval = o.rate > 0 ? o.conns / o.rate : 0;    // seconds between requests of this connection
+    auto due = start;
+    for (long n = 0;; n++) {
+        if (o.seconds > 0 ? Clock::now() >= stop : budget-- <= 0) {
+            break;
+        }
+        if (interval > 0) {
+            due = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(interval * (n + double(id) / o.conns)));
+            this_thread::sleep_until(due);
+        }
+        auto sent = interval > 0 ? due : Clock::now();
+        c.write(pct(rng) < o.writes ? writeMsg : readMsg);
+        string reply = c.read();
+        if (reply.empty()) {
+            res.errors++;
+            break;
+        }
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - sent).count();
+        res.latency.push_back(uint32_t(min<long long>(ns, UINT32_MAX)));
+    }
+    c.end();
+}
+
+double percentile(const vector<uint32_t> &v, double p)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    size_t k = min(v.size() - 1, size_t(p / 100 * v.size()));
+    return v[k] / 1000.0;
+}
+
+void report(const string &what, vector<uint32_t> &lat, long errors, double secs)
+{
+    sort(lat.begin(), lat.end());
+    cout << what << ": " << lat.size() << " requests, " << errors << " errors in " << secs << " s, "
+         << long(lat.size() / secs) << " req/s" << endl;
+    cout << "latency us: p50 " << percentile(lat, 50) << "  p99 " << percentile(lat, 99) << "  p99.9 " << percentile(lat, 99.9)
+         << "  max " << (lat.empty() ? 0 : lat.back() / 1000.0) << endl;
+}
+
+// time the request path of device.cpp without sockets, replies pile up in a corked connection
+void microBench(long iterations)
+{
+    Tcp::Router router = edgeRoutes(false);
+    sockaddr_storage addr{};
+    Tcp::Connection c(-1, -1, addr, Tcp::Framing::Newline);
+    c.corked = true;
+
+    auto time = [&](const char *what, auto fn) {
+        fn();   // warm up the pools
+        long a0 = allocations;
+        auto t0 = Clock::now();
+        for (long k = 0; k < iterations; k++) {
+            fn();
+            if ((k & 1023) == 1023) {
+                c.out = Tcp::OutQueue();
+            }
+        }
+        double ns = chrono::duration<double, nano>(Clock::now() - t0).count() / iterations;
+        double allocs = double(allocations - a0) / iterations;
+        cout << what << ": " << ns << " ns/op, " << allocs << " allocations/op" << endl;
+        c.out = Tcp::OutQueue();
+    };
+
+    time("parse", [&] { Tcp::Request req(readMsg); asm volatile("" :: "r"(req.method.data())); });
+    time("parse + serialize", [&] { Tcp::Request req(readMsg); auto r = req.reply("42"); asm volatile("" :: "r"(r.data())); });
+    time("dispatch node-edge-read", [&] { router.dispatch(c, readMsg); });
+    time("dispatch node-edge-write", [&] { router.dispatch(c, writeMsg); });
+}
+
+int main(int argc, char *argv[])
+{
+    Options o = parse(argc, argv);
+
+    if (o.micro > 0) {
+        microBench(o.micro);
+        return 0;
+    }
+
+    cout << o.conns << " connection(s) to " << o.ip << ":" << o.port << ", "
+         << (o.rate > 0 ? to_string(long(o.rate)) + " req/s" : string("closed loop")) << ", " << o.writes << "% writes" << endl;
+
+    vector<Result> results(o.conns);
+    vector<thread> threads;
+    atomic<long> budget{o.requests};
+    auto start = Clock::now() + chrono::milliseconds(10);
+    auto stop = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(o.seconds));
+    for (int k = 0; k < o.conns; k++) {
+        threads.emplace_back(worker, cref(o), k, start, stop, ref(budget), ref(results[k]));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double secs = max(1e-3, chrono::duration<double>(Clock::now() - start).count());
+
+    vector<uint32_t> lat;
+    long errors = 0;
+    for (auto &r : results) {
+        lat.insert(lat.end(), r.latency.begin(), r.latency.end());
+        errors += r.errors;
+    }
+    report("total", lat, errors, secs);
+    return errors ? 2 : 0;
+}
@@ -2,74 +2,102 @@
  * File:   device.ccp
  * Author: Ed Alegrid
  *
- * A simple C++ TCP edge connector using epoll with non-blocking read timeout.
+ * A simple C++ TCP edge connector using an epoll event loop with persistent client connections.
  * Use any Linux C++20 compliant compiler or IDE to compile the application.
  *
  */
 
 #include <memory>
 #include <iostream>
-#include <nlohmann/json.hpp>
-#include "lib/server.h"
+#include "lib/sharded.h"
+#include "routes.h"
 
 using namespace std;
-using json = nlohmann::json;
 
-int main()
+int main(int argc, char *argv[])
 {
-    auto getRandomData = [](auto j)
-    {
-        int rn = rand() % 100 + 10;
-        string rd = to_string(rn);
-        j["value"] = rd;
-        return j.dump(); 
-    };
+    // usage: ./bin/device [workers] [--pin] [--uring]
+    Tcp::ShardOptions opt;
+    opt.workers = argc > 1 ? atoi(argv[1]) : 1;
+    for (int k = 2; k < argc; k++) {
+        opt.pinCpu = opt.pinCpu || string(argv[k]) == "--pin";
+        opt.uring = opt.uring || string(argv[k]) == "--uring";
+    }
 
     cout << "\n*** C++ Tcp Edge Connector Server ***\n" << endl;
 
-    auto s = make_shared<Tcp::Server>(5300);
+    shared_ptr<Tcp::ShardedServer> s;
+    try{
+        // an instance already running from this directory hands over its sockets at once and
+        // its clients as they go quiet, under systemd socket activation the listening socket is inherited
+        Tcp::Inherited in = Tcp::HandOff::take("edge-handoff");
+        if (in.listeners.empty()) {
+            in.listeners = Tcp::listenFds();
+        }
+        if (in.listeners.empty()) {
+            // one event loop thread per worker, each with its own SO_REUSEPORT listening socket
+            s = make_shared<Tcp::ShardedServer>(5300, "127.0.0.1", opt);
+        }
+        else {
+            s = make_shared<Tcp::ShardedServer>(in.listeners, opt);
+            s->adopt(in.connections);
+            cout << "Inherited " << in.listeners.size() << " listening socket(s) and " << in.connections.size() << " connection(s)" << endl;
+        }
+    }
+    catch (SocketError& e)
+    {
+        cerr << "error: " << e.what() << endl;
+        exit(1);
+    }
 
-    cout << "Server listening on: " << s->ip << ":" << s->port << endl;
+    cout << "Server listening on: " << s->ip << ":" << s->port << " with " << s->workers() << " worker(s)" << endl;
 
-    for (;;)
+    // accepted writes are logged in ./edge-wal and applied again when the server restarts
+    unique_ptr<Tcp::WriteLog> wal;
+    try{
+        wal = make_unique<Tcp::WriteLog>("edge-wal");
+    }
+    catch (SocketError& e)
     {
-        try{
-            // wait for a client connection
-            s->wait();
-          
-            // read rcvd data from a client
-            auto data = s->read();
+        cerr << "write log error: " << e.what() << endl;
+        exit(1);
+    }
 
-            // parse rcvd json string data
-            try{
-                auto j = json::parse(data);
+    // the topics are in routes.h, shared with the bench.cpp load generator
+    Tcp::Router router = edgeRoutes(true, wal.get());
+    router.replay(*wal);
 
-                if(j["topic"] == "random-data"){
-                    auto rd = std::async(getRandomData, j);
-                    rd.wait();
-                    auto r = rd.get();
-                    s->write(r);
-                    cout << "json string result: " << r << '\n';  
-                }
-                else{
-                    cout << "invalid topic:" << s->write("invalid topic") << endl;
-                }
-                s->end();
-            }
-            catch (json::parse_error& ex)
-            {
-                // rcvd data is not a json string 
-                cerr << "json parse error at byte: " << ex.byte << endl;
-                cout << "rcvd an invalid json data: " << endl;
-                s->write("invalid json data"); 
-                s->end();
-            }
-        }
-        catch (SocketError& e)
-        {
-            cerr << "error: " << e.what() << endl;
-            exit(1);
-        }
+    // called for every request, client connections stay open between requests
+    s->onRequest(router);
+
+    // clients that stay silent for 5 minutes are let go, see Tcp::Timeouts for the other deadlines
+    Tcp::Timeouts t;
+    t.idle = 300000;
+    s->setTimeouts(t);
+
+    // the next instance started from this directory takes over without dropping a client
+    unique_ptr<Tcp::HandOff> handoff;
+    try{
+        handoff = make_unique<Tcp::HandOff>("edge-handoff", [s] { return s->listeners(); }, [s](auto keep) { s->drain(keep); });
+    }
+    catch (SocketError& e)
+    {
+        cerr << "hot restart is off: " << e.what() << endl;
+    }
+
+    try{
+        s->run();
+    }
+    catch (SocketError& e)
+    {
+        cerr << "error: " << e.what() << endl;
+        exit(1);
+    }
+
+    // the next instance replays this log, it must be complete before it opens it
+    wal.reset();
+    if (handoff) {
+        handoff->finish();
     }
   
     return 0;
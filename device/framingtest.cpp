@@ -0,0 +1,205 @@
+/*
+ * File:   framingtest.cpp
+ * Author: Ed Alegrid
+ *
+ * Tests of the message framer in lib/framing.h and the request scanner in lib/request.h, the
+ * bytes are fed the way they come off a socket, in pieces that split messages anywhere.
+ * Exits with 1 if a check failed.
+ *
+ * $ g++ -Wall -O2 framingtest.cpp -o bin/framingtest -std=c++20 -pthread
+ * $ ./bin/framingtest
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "lib/request.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+    cout << (ok ? "ok   " : "FAIL ") << what << endl;
+    if (!ok) {
+        failures++;
+    }
+}
+
+// the messages f frames out of the pieces, appended one after the other
+static vector<string> feed(Tcp::Framer &f, const vector<string> &pieces)
+{
+    vector<string> got;
+    string_view msg;
+    for (auto &p : pieces) {
+        f.append(p.data(), p.size());
+        while (f.next(msg)) {
+            got.emplace_back(msg);
+        }
+    }
+    return got;
+}
+
+// what a connection sends for a reply, see Connection::write()
+static string framed(Tcp::Framer &f, const string &reply)
+{
+    char h[4];
+    string out(h, f.header(reply.size(), h));
+    out.append(reply);
+    out.append(f.trailer());
+    return out;
+}
+
+static string lengthPrefixed(const string &msg)
+{
+    string out(4, '\0');
+    for (int k = 0; k < 4; k++) {
+        out[k] = char((msg.size() >> (24 - 8 * k)) & 0xff);
+    }
+    return out + msg;
+}
+
+static void testNewline()
+{
+    Tcp::Framer f(Tcp::Framing::Newline);
+    auto got = feed(f, {"first\r", "\nsec", "ond\n", "\r\n", "\nthird\n"});
+    check(got == vector<string>{"first", "second", "third"}, "newline framing drops the \\r of \\r\\n, empty lines and joins split lines");
+}
+
+static void testLength()
+{
+    Tcp::Framer f;
+    string a = lengthPrefixed("{\"topic\":\"a\"}"), b = lengthPrefixed(string(300, 'x'));
+    string all = a + b;
+    // the 4 byte length itself arrives in two pieces
+    auto got = feed(f, {all.substr(0, 2), all.substr(2, 3), all.substr(5, a.size() + 1), all.substr(a.size() + 6)});
+    check(f.framing() == Tcp::Framing::Length, "a leading zero byte selects length framing");
+    check(got == vector<string>{"{\"topic\":\"a\"}", string(300, 'x')}, "a length prefix split across appends");
+    check(framed(f, "ok") == lengthPrefixed("ok"), "replies are length prefixed");
+}
+
+static void testOversized()
+{
+    Tcp::Framer f(Tcp::Framing::Length, 1024);
+    string big = lengthPrefixed(string(2048, 'x')).substr(0, 100);
+    bool threw = false;
+    try {
+        feed(f, {big});
+    }
+    catch (SocketError &) {
+        threw = true;
+    }
+    check(threw, "a length over the maximum frame size throws");
+
+    Tcp::Framer j(Tcp::Framing::Json, 1024);
+    threw = false;
+    try {
+        feed(j, {"{\"value\":\"" + string(2048, 'x')});
+    }
+    catch (SocketError &) {
+        threw = true;
+    }
+    check(threw, "an unterminated json message over the maximum frame size throws");
+}
+
+static void testJsonStrings()
+{
+    Tcp::Framer f;
+    string m1 = R"({"payload":"a } b { c","value":"\"}"})", m2 = R"([{"x":"\\"},"]"])";
+    auto got = feed(f, {m1.substr(0, 14), m1.substr(14) + "  " + m2.substr(0, 9), m2.substr(9)});
+    check(got == vector<string>{m1, m2}, "quotes, escapes and braces inside strings do not end a message");
+}
+
+static void testNotJson()
+{
+    Tcp::Framer f(Tcp::Framing::Json);
+    auto got = feed(f, {"{\"a\":1}", " hello world"});
+    check(got == vector<string>{"{\"a\":1}", "hello world"}, "bytes that are not json are passed on as they are");
+
+    Tcp::Framer a;
+    got = feed(a, {"hello"});
+    check(a.framing() == Tcp::Framing::Raw && got == vector<string>{"hello"}, "auto framing takes other bytes as raw");
+}
+
+static void testDelimited()
+{
+    // the newline arrives in a piece of its own after the request was answered
+    Tcp::Framer f;
+    auto got = feed(f, {"{\"a\":1}"});
+    string first = framed(f, "{\"r\":1}");
+    check(got.size() == 1 && first == "{\"r\":1}", "a reply before the delimiting is known has no trailer");
+    check(!f.closeLine(), "no newline is owed while it is not known");
+    feed(f, {"\n"});
+    check(f.closeLine(), "a newline after the first message ends the line of the reply");
+    check(!f.closeLine(), "the line is ended once");
+    check(framed(f, "{\"r\":2}") == "{\"r\":2}\n", "later replies end with a newline");
+
+    Tcp::Framer crlf;
+    got = feed(crlf, {"{\"a\":1}\r\n{\"b\":2}\r", "\n"});
+    check(got.size() == 2 && framed(crlf, "{}") == "{}\n", "\\r\\n delimited json gets newline replies");
+
+    // several replies before it is known start on lines of their own
+    Tcp::Framer s;
+    feed(s, {"{\"subscribe\":1}  "});
+    string out = framed(s, "{\"u\":1}");
+    out += framed(s, "{\"u\":2}");
+    feed(s, {" \n"});
+    out += s.closeLine() ? "\n" : "";
+    check(out == "{\"u\":1}\n{\"u\":2}\n", "replies sent before the newline each end up on a line of their own");
+
+    // the next message right after the first one means no newlines, decided once
+    Tcp::Framer p;
+    got = feed(p, {"{\"a\":1}", "{\"b\":2}", "\n{\"c\":3}"});
+    check(got.size() == 3 && !p.closeLine() && framed(p, "{}") == "{}", "plain json replies have no trailer");
+}
+
+static bool throws(const string &msg)
+{
+    try {
+        Tcp::Request r(msg);
+        return false;
+    }
+    catch (Tcp::json::exception &) {
+        return true;
+    }
+}
+
+static void testScanner()
+{
+    Tcp::Request r(R"({"id":7,"topic":"t","method":"m","payload":"p","maxAge":250,"deadband":1.5e0,"interval":100,"value":{"a":[1,"}"]}})");
+    check(r.id == 7 && r.topic == "t" && r.method == "m" && r.payload == "p" && r.hasPayload, "scanner reads the header fields");
+    check(r.maxAge == 250 && r.deadband == 1.5 && r.interval == 100, "scanner reads the numeric options");
+    check(string(r.reply("x\"y")) == R"({"id":7,"topic":"t","method":"m","payload":"p","maxAge":250,"deadband":1.5e0,"interval":100,"value":"x\"y"})",
+          "reply splices a quoted value over a nested one");
+
+    Tcp::Request n(R"( { "topic" : "t" } )");
+    check(string(n.replyJson("[1,2]")) == R"( { "topic" : "t" ,"value":[1,2]} )", "reply adds a value member before the closing brace");
+    Tcp::Request e("{}");
+    check(string(e.reply("v")) == R"({"value":"v"})", "reply to an empty object");
+
+    Tcp::Request esc(R"({"topic":"a\"b","payload":5})");
+    check(esc.topic == "a\"b" && !esc.hasPayload, "escaped fields and a non-string payload go through the json parser");
+
+    for (string bad : {R"({"a":01})", R"({"a":1.})", R"({"a":-})", R"({"a":tru})", R"({"a":"\x"})", "{\"a\":\"\x01\"}",
+                       R"({"a":[1,]})", R"({"a":1,})", R"({"a":1} x)", R"({"a":{"b":1})"}) {
+        check(throws(bad), "invalid json is refused: " + bad);
+    }
+    for (string good : {R"({"a":-0.5e+3})", R"({"a":"é\n"})", R"({"a":[true,false,null,{}]})", R"({"a":[[[]]]})"}) {
+        check(!throws(good), "valid json is taken: " + good);
+    }
+}
+
+int main()
+{
+    testNewline();
+    testLength();
+    testOversized();
+    testJsonStrings();
+    testNotJson();
+    testDelimited();
+    testScanner();
+    cout << (failures ? to_string(failures) + " failed" : "all passed") << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * Source File: asyncclient.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "socketerror.h"
+#include "log.h"
+#include "framing.h"
+#include "outqueue.h"
+#include "request.h"
+
+#define POOL_SIZE       2       // connections per endpoint
+#define MAX_PIPELINE    128     // outstanding requests per connection
+#define MAX_EVENTS      32
+
+namespace Tcp {
+
+using namespace std;
+
+// reply or failure of one AsyncClient request, err is 0 or an errno value
+// (ECONNREFUSED, ETIMEDOUT, ECONNRESET, ECANCELED ...)
+using ReplyHandler = function<void(string reply, int err)>;
+
+struct AsyncOptions
+{
+    int poolSize = POOL_SIZE;
+    int maxPipeline = MAX_PIPELINE;
+    int connectTimeout = 1000;  // ms
+    int requestTimeout = 2000;  // ms, -1 waits forever
+    Framing framing = Framing::Length;  // every reply arrives whole, even a plain text one
+};
+
+// non-blocking client for aggregators that poll many connectors at once
+//
+// one background thread runs an epoll loop over a pool of persistent connections per endpoint,
+// requests are pipelined on them and completed through a callback or a future
+// json object requests get an "id" member the server echoes back, replies are matched by it
+// and otherwise by order, replies of one connection always come back in request order
+class AsyncClient
+{
+    using Clock = chrono::steady_clock;
+
+    struct Job
+    {
+        uint64_t id;
+        string msg;
+        ReplyHandler cb;
+        Clock::time_point deadline;
+    };
+
+    struct Endpoint;
+
+    // one pooled connection
+    struct Link
+    {
+        int fd = -1;
+        bool connected = false;
+        Clock::time_point connectBy;
+        Framer framer;
+        OutQueue out;
+        deque<Job> inflight;    // sent or queued, waiting for a reply
+        Endpoint *ep = nullptr;
+
+        Link(Framing f) : framer{f} {}
+    };
+
+    struct Endpoint
+    {
+        string ip;
+        int port = 0;
+        vector<unique_ptr<Link>> links;
+        deque<Job> waiting;     // every connection of the pool is at maxPipeline
+    };
+
+    struct Submit
+    {
+        string ip;
+        int port;
+        string msg;
+        ReplyHandler cb;
+    };
+
+    AsyncOptions opt;
+    int epfd = -1, wakefd = -1;
+    atomic<bool> stopped{false};
+    thread io;
+    uint64_t nextId = 0;
+
+    mutex lock;             // guards incoming, everything else belongs to the io thread
+    vector<Submit> incoming;
+
+    unordered_map<string, Endpoint> endpoints;
+    unordered_map<int, Link *> links;
+
+    // add "id":N as the first member of a json object, other messages are sent as they are
+    static string tag(const string &msg, uint64_t id)
+    {
+        size_t b = msg.find_first_not_of(" \t\r\n");
+        if (b == string::npos || msg[b] != '{') {
+            return msg;
+        }
+        size_t n = msg.find_first_not_of(" \t\r\n", b + 1);
+        string out;
+        out.reserve(msg.size() + 24);
+        out.append(msg, 0, b + 1);
+        out.append("\"id\":");
+        out.append(to_string(id));
+        if (n != string::npos && msg[n] != '}') {
+            out.push_back(',');
+        }
+        out.append(msg, b + 1, string::npos);
+        return out;
+    }
+
+    static uint64_t replyId(string_view msg)
+    {
+        try
+        {
+            return Request(msg).id;
+        }
+        catch (json::exception&)
+        {
+            return 0;   // not json, e.g. "invalid topic"
+        }
+    }
+
+    void watch(int fd, uint32_t events, int op = EPOLL_CTL_ADD)
+    {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+            throw SocketError();
+        }
+    }
+
+    // start a non-blocking connect, completion is reported by EPOLLOUT
+    Link *open(Endpoint &ep)
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        addrinfo *info{};
+        if (getaddrinfo(ep.ip.c_str(), to_string(ep.port).c_str(), &hints, &info) != 0) {
+            errno = EHOSTUNREACH;
+            return nullptr;
+        }
+        int fd = socket(info->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int r = fd < 0 ? -1 : connect(fd, info->ai_addr, info->ai_addrlen);
+        int err = errno;
+        freeaddrinfo(info);
+        if (fd < 0 || (r < 0 && err != EINPROGRESS)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            errno = err;
+            return nullptr;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto l = make_unique<Link>(opt.framing);
+        l->fd = fd;
+        l->ep = &ep;
+        l->connected = r == 0;
+        l->connectBy = Clock::now() + chrono::milliseconds(opt.connectTimeout);
+        watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+        links[fd] = l.get();
+        ep.links.push_back(move(l));
+        return ep.links.back().get();
+    }
+
+    // close the connection and fail whatever it still owes
+    void fail(Link *l, int err)
+    {
+        Endpoint &ep = *l->ep;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, l->fd, NULL);
+        close(l->fd);
+        links.erase(l->fd);
+        deque<Job> jobs = move(l->inflight);
+        ep.links.erase(find_if(ep.links.begin(), ep.links.end(), [l](auto &p) { return p.get() == l; }));
+        for (auto &j : jobs) {
+            j.cb({}, err);
+        }
+        assign(ep);
+    }
+
+    // hand waiting requests to the least busy connection, opening new ones up to the pool size
+    void assign(Endpoint &ep)
+    {
+        while (!ep.waiting.empty())
+        {
+            Link *best = nullptr;
+            for (auto &l : ep.links) {
+                if (int(l->inflight.size()) < opt.maxPipeline && (!best || l->inflight.size() < best->inflight.size())) {
+                    best = l.get();
+                }
+            }
+            if ((!best || !best->inflight.empty()) && int(ep.links.size()) < opt.poolSize) {
+                if (Link *l = open(ep)) {
+                    best = l;
+                }
+                else if (!best) {
+                    int err = errno;
+                    deque<Job> jobs = move(ep.waiting);
+                    for (auto &j : jobs) {
+                        j.cb({}, err);
+                    }
+                    return;
+                }
+            }
+            if (!best) {
+                break;
+            }
+            Job &j = ep.waiting.front();
+            best->out.push(best->framer.frame(tag(j.msg, j.id)));
+            j.msg.clear();
+            best->inflight.push_back(move(j));
+            ep.waiting.pop_front();
+        }
+        for (size_t k = 0; k < ep.links.size(); k++) {
+            Link *l = ep.links[k].get();
+            if (l->connected && !l->out.empty() && l->out.flush(l->fd) < 0) {
+                fail(l, errno);
+                return;
+            }
+        }
+    }
+
+    void complete(Link *l, string_view msg)
+    {
+        if (l->inflight.empty()) {
+            return;     // unsolicited message
+        }
+        auto it = l->inflight.begin();
+        if (uint64_t id = replyId(msg)) {
+            it = find_if(l->inflight.begin(), l->inflight.end(), [id](const Job &j) { return j.id == id; });
+            if (it == l->inflight.end()) {
+                return;
+            }
+        }
+        ReplyHandler cb = move(it->cb);
+        l->inflight.erase(it);
+        cb(string(msg), 0);
+    }
+
+    void event(Link *l, uint32_t events)
+    {
+        if (!l->connected) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err || (events & (EPOLLERR | EPOLLHUP))) {
+                fail(l, err ? err : ECONNREFUSED);
+                return;
+            }
+            if (!(events & EPOLLOUT)) {
+                return;
+            }
+            l->connected = true;
+        }
+        if (!l->out.empty() && l->out.flush(l->fd) < 0) {
+            fail(l, errno);
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            int r;
+            try
+            {
+                r = l->framer.fill(l->fd);
+                string_view msg;
+                while (l->framer.next(msg)) {
+                    complete(l, msg);
+                }
+            }
+            catch (SocketError&)
+            {
+                r = -1;
+                errno = EMSGSIZE;
+            }
+            if (r <= 0) {
+                fail(l, r == 0 ? ECONNRESET : errno);
+                return;
+            }
+            // a reply may have freed a pipeline slot
+            if (!l->ep->waiting.empty()) {
+                assign(*l->ep);
+            }
+        }
+    }
+
+    // fail expired requests and connects, returns ms until the next deadline or -1
+    int expire()
+    {
+        auto now = Clock::now();
+        auto next = Clock::time_point::max();
+        for (auto &[key, ep] : endpoints) {
+            while (!ep.waiting.empty() && ep.waiting.front().deadline <= now) {
+                Job j = move(ep.waiting.front());
+                ep.waiting.pop_front();
+                j.cb({}, ETIMEDOUT);
+            }
+            if (!ep.waiting.empty()) {
+                next = min(next, ep.waiting.front().deadline);
+            }
+            for (size_t k = 0; k < ep.links.size();) {
+                Link *l = ep.links[k].get();
+                // replies come in order, a late one would stall the rest of the pipeline anyway
+                if ((!l->connected && l->connectBy <= now) || (!l->inflight.empty() && l->inflight.front().deadline <= now)) {
+                    fail(l, ETIMEDOUT);
+                    continue;
+                }
+                if (!l->connected) {
+                    next = min(next, l->connectBy);
+                }
+                if (!l->inflight.empty()) {
+                    next = min(next, l->inflight.front().deadline);
+                }
+                k++;
+            }
+        }
+        if (next == Clock::time_point::max()) {
+            return -1;
+        }
+        auto ms = chrono::duration_cast<chrono::milliseconds>(next - now).count() + 1;
+        return int(min<decltype(ms)>(ms, 60000));
+    }
+
+    void accept(vector<Submit> &batch)
+    {
+        auto now = Clock::now();
+        auto limit = opt.requestTimeout < 0 ? Clock::duration::max() / 2 : chrono::duration_cast<Clock::duration>(chrono::milliseconds(opt.requestTimeout));
+        for (auto &s : batch) {
+            Endpoint &ep = endpoints[s.ip + ":" + to_string(s.port)];
+            ep.ip = s.ip;
+            ep.port = s.port;
+            ep.waiting.push_back(Job{++nextId, move(s.msg), move(s.cb), now + limit});
+        }
+        for (auto &[key, ep] : endpoints) {
+            if (!ep.waiting.empty()) {
+                assign(ep);
+            }
+        }
+    }
+
+    void loop()
+    {
+        epoll_event events[MAX_EVENTS];
+        vector<Submit> batch;
+        while (!stopped)
+        {
+            int n = epoll_wait(epfd, events, MAX_EVENTS, expire());
+            if (n < 0 && errno != EINTR) {
+                LOG_ERROR("AsyncClient epoll error: %s", strerror(errno));
+                break;
+            }
+            for (int k = 0; k < n; k++) {
+                int fd = events[k].data.fd;
+                if (fd == wakefd) {
+                    uint64_t v;
+                    while (::read(wakefd, &v, sizeof(v)) > 0) {}
+                    {
+                        lock_guard<mutex> g(lock);
+                        batch.swap(incoming);
+                    }
+                    accept(batch);
+                    batch.clear();
+                    continue;
+                }
+                auto it = links.find(fd);
+                if (it != links.end()) {
+                    event(it->second, events[k].events);
+                }
+            }
+        }
+
+        // fail everything still outstanding, waiting requests first so fail() opens nothing new
+        for (auto &[key, ep] : endpoints) {
+            deque<Job> jobs = move(ep.waiting);
+            for (auto &j : jobs) {
+                j.cb({}, ECANCELED);
+            }
+            while (!ep.links.empty()) {
+                fail(ep.links.front().get(), ECANCELED);
+            }
+        }
+        {
+            lock_guard<mutex> g(lock);
+            batch.swap(incoming);
+        }
+        for (auto &s : batch) {
+            s.cb({}, ECANCELED);
+        }
+    }
+
+    public:
+        AsyncClient(AsyncOptions o = {}) : opt{o}
+        {
+            opt.poolSize = max(opt.poolSize, 1);
+            opt.maxPipeline = max(opt.maxPipeline, 1);
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+            wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epfd < 0 || wakefd < 0) {
+                throw SocketError();
+            }
+            watch(wakefd, EPOLLIN);
+            io = thread([this] { loop(); });
+        }
+        AsyncClient(const AsyncClient&) = delete;
+        AsyncClient& operator=(const AsyncClient&) = delete;
+
+        virtual ~AsyncClient()
+        {
+            {
+                // a request() from now on sees it, none gets in after the loop's last look
+                lock_guard<mutex> g(lock);
+                stopped = true;
+            }
+            uint64_t one = 1;
+            ::write(wakefd, &one, sizeof(one));
+            io.join();
+            vector<Submit> left;
+            {
+                lock_guard<mutex> g(lock);
+                left.swap(incoming);
+            }
+            for (auto &s : left) {
+                s.cb({}, ECANCELED);
+            }
+            close(wakefd);
+            close(epfd);
+        }
+
+        // send msg to the connector at ip:port, cb runs on the client thread and must not block
+        void request(const string &ip, int port, string msg, ReplyHandler cb)
+        {
+            {
+                lock_guard<mutex> g(lock);
+                if (!stopped) {
+                    incoming.push_back(Submit{ip, port, move(msg), move(cb)});
+                    cb = nullptr;
+                }
+            }
+            if (cb) {
+                // the client is closing, cb may call request() again, so not under the lock
+                cb({}, ECANCELED);
+                return;
+            }
+            uint64_t one = 1;
+            ::write(wakefd, &one, sizeof(one));
+        }
+
+        // same as above, the future throws a SocketError if the request failed
+        future<string> request(const string &ip, int port, string msg)
+        {
+            auto p = make_shared<promise<string>>();
+            auto f = p->get_future();
+            request(ip, port, move(msg), [p](string reply, int err) {
+                if (err) {
+                    p->set_exception(make_exception_ptr(SocketError(strerror(err))));
+                }
+                else {
+                    p->set_value(move(reply));
+                }
+            });
+            return f;
+        }
+};
+
+}
@@ -11,10 +11,16 @@
 #include <errno.h>
 #include <sys/fcntl.h>
 #include <future>
+#include <chrono>
+#include <poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h> 
 #include <netdb.h>
 #include "socketerror.h"
+#include "log.h"
+#include "framing.h"
+#include "outqueue.h"
+#include "unixsocket.h"
 
 #define BUF_SIZE  512
 
@@ -24,8 +30,11 @@ using namespace std;
 
 class Client
 {
-    int sockfd, rv; 
+    int sockfd = -1, rv; 
     char s[INET6_ADDRSTRLEN];
+    Framer framer;  // replies received but not yet returned by read()
+    int readTimeout = 2000;
+    int connectTimeout = 2000;
 
     void *get_addr(struct sockaddr *sa)
     {
@@ -52,28 +61,36 @@ class Client
             }
 
             if ((rv = getaddrinfo(Ip.c_str(), prt.c_str(), &hints, &servinfo)) != 0) { 
-                cout << "getaddrinfo: " << gai_strerror(rv) << endl;
+                LOG_ERROR("getaddrinfo: %s", gai_strerror(rv));
                 throw SocketError("Invalid address");
             }
-            sockfd = {socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)};
+            // connect without blocking so an unreachable connector fails after connectTimeout ms
+            sockfd = {socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, servinfo->ai_protocol)};
+            if (sockfd < 0) {
+                throw SocketError();
+            }
             int result{ connect(sockfd, servinfo->ai_addr, servinfo->ai_addrlen)};
             if (result < 0)
             {
-                 //cout << "connection fail " << Ip << ":" << Port << endl;
-                if (fcntl(sockfd, F_SETFL, O_NONBLOCK, O_ASYNC ) <= 0){
+                if (errno != EINPROGRESS) {
+                    throw SocketError();
+                }
+                pollfd p{sockfd, POLLOUT, 0};
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if ((result = poll(&p, 1, connectTimeout)) <= 0) {
+                    errno = result == 0 ? ETIMEDOUT : errno;
+                    throw SocketError();
+                }
+                if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                    errno = err ? err : errno;
                     throw SocketError();
                 }
-            }
-            else
-            {
-                // details of remote connected endpoint
-                inet_ntop(servinfo->ai_family, get_addr((struct sockaddr *)servinfo->ai_addr), s, sizeof s);
-                //cout << "Client connected to: " << s << ":" << port << endl; 
             }
 
-            if (servinfo == nullptr) {
-                throw SocketError("connect fail ...");
-            }
+            // details of remote connected endpoint
+            inet_ntop(servinfo->ai_family, get_addr((struct sockaddr *)servinfo->ai_addr), s, sizeof s);
+            //cout << "Client connected to: " << s << ":" << port << endl; 
 
             freeaddrinfo(servinfo);
 
@@ -82,7 +99,10 @@ class Client
         catch (SocketError& e)
         {
             //cerr << "socket initialize error: " << e.what() << endl;
-            cout << "Connection fail: " << Ip << ":" << Port << " " <<  e.what() << " " << fcntl(sockfd, F_SETFL) << endl;
+            LOG_ERROR("Connection fail: %s:%d %s", Ip.c_str(), Port, e.what());
+            if (servinfo) {
+                freeaddrinfo(servinfo);
+            }
             closeHandler();
             //exit(1);
             return 1;
@@ -90,6 +110,31 @@ class Client
         return 0;
     }
 
+    int initUnixSocket(const string &path)
+    {
+        ip = path;
+        port = 0;
+
+        try{
+            sockaddr_un addr;
+            socklen_t len = unixAddress(path, addr);
+            sockfd = {socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+            if (sockfd < 0) {
+                throw SocketError();
+            }
+            if (connect(sockfd, (struct sockaddr *)&addr, len) < 0) {
+                throw SocketError();
+            }
+            return 0;
+        }
+        catch (SocketError& e)
+        {
+            LOG_ERROR("Connection fail: %s %s", path.c_str(), e.what());
+            closeHandler();
+            return 1;
+        }
+    }
+
     void closeHandler() const
     {
         end();
@@ -109,114 +154,132 @@ class Client
     void setNoBlock(){
         int n = 1;
         try{
-            if (( n = {fcntl(sockfd, F_SETFL, O_NONBLOCK, O_ASYNC)}) < 0){
+            if ((n = fcntl(sockfd, F_GETFL)) < 0 || fcntl(sockfd, F_SETFL, n | O_NONBLOCK) < 0){
                 throw SocketError();
             }
             //cout << "setNoBlock n = " << n << endl;
         }
         catch (SocketError& e)
         {
-            cerr << "setNoBlock error: " << e.what() << endl;
+            LOG_ERROR("setNoBlock error: %s", e.what());
             closeHandler();
         }  
     }
 
+    // how messages are delimited on the wire, the default Auto sends messages as they are
+    // and detects the framing of the replies from the server
+    void setFraming(Framing f)
+    {
+        framer.setFraming(f);
+    }
+
     virtual void serverConnect(const int port, const string ip = "127.0.0.1")
     {
         initSocket(port, ip);
     }
 
-    virtual const string readSync()
+    // connect to a same-host server over a unix domain socket, path is a socket file
+    // or "@name" for the abstract namespace, returns 0 on success
+    int unixConnect(const string &path)
     {
-	    char buffer[1024];
-        try
-        {
-            int x = 0;
-            ssize_t n = 1;
-            bzero(buffer, sizeof(buffer));
-            while (( n = {recv(sockfd, buffer, sizeof(buffer), 0)} ) < 0) {  
-                bzero(buffer, sizeof(buffer));
-                if(x == 10000000){ break; } // wait 2 secs
-                x++;
-	        }
-            //cout << "client read sync n = " << n << " bytes, x = " << x << endl; 
-            if (n < 0) {
-                cout << "readSync error: no available data\n" << endl;
-            }
-            if (n == 0){
-                cout << "readSync error, socket is closed or disconnected\n";
-            }        
-        }
-        catch (SocketError& e)
-        {
-            cerr << "readSync error: " << e.what() << endl;
-            closeHandler();
-        }
-        return buffer;
+        return initUnixSocket(path);
     }
 
-    virtual const string read(int bufsize=1024) 
+    // pid, uid and gid of the server process, unix domain connections only
+    bool peer(ucred &cred) const
     {
+        return peerCredentials(sockfd, cred);
+    }
 
+    // wait for the next complete message, same as read()
+    virtual const string readSync()
+    {
+        return read();
+    }
+
+    // wait up to timeout ms for the next complete message from the server
+    // a timeout of -1 uses the setReadTimeout() value, returns an empty string if no message arrived
+    virtual const string read(int bufsize=1024, int timeout=-1) 
+    {
 	    string ad;
+        string_view msg;
+
+        // a reply pipelined behind the previous one is already buffered
+        if (framer.next(msg)) {
+            return string(msg);
+        }
+
         try
         { 
-            auto l = [bufsize] (const int fd) 
-            {
-              string s;
-              int x = 0;
-              ssize_t n = 1;
-              char buffer[BUF_SIZE];
-
-              if(bufsize){
-                *buffer = buffer[bufsize];
-              } 
-              
-              bzero(buffer, sizeof(buffer));
-
-              while (( n = {recv(fd, buffer, sizeof(buffer), 0)} ) < 0) {  
-		        bzero(buffer, sizeof(buffer));
-                //if (n < 0) { break; }
-                if(x == 10000000){ break; } // wait 2 secs
-                x++;
-	          }
-              //cout << "client read async n = " << n << " bytes, x = " << x << endl;
-              if (n < 0) {
-                cout << "read error: no available data\n" << endl;
-              }
-              if (n == 0){
-                cout << "read error, socket is closed or disconnected\n";
-              }
-              s = &buffer[0];  
-              return s; 
-            };
-
             if (fcntl(sockfd, F_GETFL) < 0 && errno == EBADF) {
                throw SocketError();
             }
 
-            ad = async(l, sockfd).get();
+            int ms = timeout < 0 ? readTimeout : timeout;
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+
+            for (;;)
+            {
+                int r = framer.fill(sockfd);
+                if (framer.next(msg)) {
+                    ad = msg;
+                    break;
+                }
+                if (r == 0){
+                    LOG_WARN("read error, socket is closed or disconnected");
+                    break;
+                }
+                if (r < 0) {
+                    throw SocketError();
+                }
+
+                // sleep in poll() until data arrives or the deadline passes
+                int wait = -1;
+                if (ms >= 0) {
+                    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                    if (left <= 0) {
+                        LOG_WARN("read error: no available data");
+                        break;
+                    }
+                    wait = left;
+                }
+                pollfd p{sockfd, POLLIN, 0};
+                if (poll(&p, 1, wait) < 0 && errno != EINTR) {
+                    throw SocketError();
+                }
+            }
         }
         catch (SocketError& e)
         {
-            cerr << "read error: " << e.what() << endl;
+            LOG_ERROR("read error: %s", e.what());
             closeHandler();
         }
         return ad;
     }
 
+    // how long serverConnect() waits for the connection in ms, use before connecting
+    void setConnectTimeout(int ms)
+    {
+        connectTimeout = ms;
+    }
+
+    // default read() timeout in ms, -1 waits until a message arrives
+    void setReadTimeout(int ms)
+    {
+        readTimeout = ms;
+    }
+
     virtual string sendSync(const string msg) const
     {
 	    try
 	    {
-            int n = send(sockfd, msg.c_str(), strlen(msg.c_str()), 0);
-	        if (n < 0) {
+            if (sendAll(sockfd, msg) < msg.size()) {
 	            throw SocketError();
 	        }
 	    }
 	    catch (SocketError& e)
 	    {
-	        cerr << "sendSync error: " << e.what() << endl;
+	        LOG_ERROR("sendSync error: %s", e.what());
 	        closeHandler();
 	    }
 	    return msg;
@@ -227,26 +290,19 @@ class Client
 
    	    try
 	    {
-	        auto l = [] (const int fd, const string &msg)
-	        {
-	            // cout << "client send async using lambda function." << endl; 
-	            ssize_t n{send(fd, msg.c_str(), strlen(msg.c_str()), 0)};
-	            //if (n < 0) { throw SocketError(); }
-                return n;
-	        };
-
             if (fcntl(sockfd, F_GETFL) < 0 && errno == EBADF) {
                 throw SocketError();
             }
 
-            auto n = async(l, sockfd, msg).get();
-            if (n < 0) {
+            // send inline, a short write waits for the socket to drain instead of truncating the message
+            string out = framer.frame(msg);
+            if (sendAll(sockfd, out) < out.size()) {
 	            throw SocketError();
 	        }
 	    }
 	    catch (SocketError& e)
 	    {
-            cerr << "write error: " << e.what() << endl;
+            LOG_ERROR("write error: %s", e.what());
 	        closeHandler();
 	    }
 	    return msg;
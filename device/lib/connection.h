@@ -0,0 +1,262 @@
+/*
+ * Source File: connection.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <iostream>
+#include <sys/socket.h>
+#include "socketerror.h"
+#include "log.h"
+#include "framing.h"
+#include "outqueue.h"
+#include "metrics.h"
+#include "shm.h"
+#include "uring.h"
+#include "pool.h"
+#include "timerwheel.h"
+#include "executor.h"
+
+namespace Tcp {
+
+using namespace std;
+
+class Connection;
+class Subscriptions;
+class Stream;
+
+// reactor mode callback, called once for every complete message received on a connection
+// the message view is only valid during the call
+using RequestHandler = function<void(Connection&, string_view)>;
+
+// reactor mode deadlines of a Server in ms, -1 disables one
+struct Timeouts
+{
+    int idle = -1;          // close a connection that sent nothing for this long
+    int read = 10000;       // a message that has started arriving must be complete within this long
+    int write = 30000;      // queued replies must start moving to the client within this long
+    int handler = 1000;     // a handler that runs longer is counted and logged, it is not interrupted
+};
+
+// request classes for load shedding, see Limits, a higher class is shed later
+enum class Priority
+{
+    Bulk,       // shed first, e.g. large reads
+    Normal,
+    Control     // never shed, e.g. stats and configuration
+};
+
+// per topic options of a Router route, set on the connection for the request being handled
+// write and handler override the server's Timeouts, -1 keeps them
+struct RouteOptions
+{
+    int write = -1;
+    int handler = -1;
+    Priority priority = Priority::Normal;
+    int ttl = 0;    // ms identical node-edge-read requests get the same serialized reply, 0 runs the handler for each
+};
+
+// one accepted client socket owned by the Server event loop, slab allocated
+class Connection : public Pooled<Connection>
+{
+    int epfd;
+    bool writing = false;   // EPOLLOUT is armed until the output queue drains
+
+    void watch(bool out)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | (out ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        writing = out;
+    }
+
+    public:
+        Connection(int Fd, int Epfd, const sockaddr_storage &addr, Framing f = Framing::Auto) : epfd{Epfd}, fd{Fd}, peer{addr}, framer{f} {}
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+        ~Connection() { if (fd >= 0) { close(fd); } }
+
+        int fd;
+        sockaddr_storage peer;  // sockaddr_in for tcp clients, sockaddr_un for unix domain clients
+        ucred cred{0, uid_t(-1), gid_t(-1)};   // peer process credentials, unix domain clients only
+        Framer framer;          // bytes received but not yet handed to the request handler
+        OutQueue out;           // replies the socket has not taken yet
+        bool corked = false;    // set by the server while it dispatches a batch of requests, flushed once after
+        bool closing = false;   // close the connection once the output queue is sent
+        bool failed = false;    // the socket is unusable, close without sending the output queue
+        Encoding encoding = Encoding::Json;
+        unique_ptr<ShmChannel> shm; // shared memory client, fd is then the control socket of the channel
+        size_t received = 0;    // messages dispatched so far, the first one may negotiate the encoding
+        Subscriptions *subs = nullptr;  // topic subscriptions of the event loop that owns the connection
+        unique_ptr<UringIo> uring;      // io_uring event loop, it submits the output queue in batches
+        RouteOptions limits;    // of the request being handled
+        string *replyCopy = nullptr;    // set by the Router while a cached route runs, gets the reply it writes
+
+        // admission control, kept by the server, see Limits
+        Priority admit = Priority::Bulk;    // lowest class served right now, lower ones get the busy reply
+        size_t inflight = 0;    // requests handled since the output queue was last empty
+        bool paused = false;    // over its limits, not read until its replies drain
+        size_t countedInflight = 0, countedOutput = 0;  // its share of the loop totals
+
+        // blocking handlers run on an Executor, their reply comes back through the loop's queue
+        CompletionQueue *completions = nullptr;
+        uint64_t id = 0;        // tells the connection from a later one on the same fd
+        bool awaiting = false;  // a reply is being made on the executor, later requests wait for it
+
+        // logged writes waiting for the write log, each with the replies written after it
+        struct Held
+        {
+            string after;       // framed
+            vector<string> messages;    // the same for a shm client, one message each
+        };
+        deque<Held> held;
+        shared_ptr<Stream> stream;  // coroutine of the connection, see Server::onConnection()
+
+        // deadlines, kept by the server on its TimerWheel, times are wheel ms
+        Timer timer;            // due at the earliest deadline
+        int64_t active = 0;     // last bytes received or sent
+        int64_t readSince = 0;  // a partial message is buffered since, 0 if none
+        int64_t writeSince = 0; // the output queue is waiting since, 0 if empty
+        uint64_t sentSeen = 0;  // out.sent() when last looked at
+        int writeLimit = -1;    // write timeout of the request that queued the output
+
+        // queue msg framed the way the client frames its requests and send it without blocking,
+        // whatever the socket does not take is sent when it becomes writable again
+        void write(string_view msg)
+        {
+            if (replyCopy) {
+                replyCopy->assign(msg);
+                replyCopy = nullptr;
+            }
+            Metrics::local().bytesOut.add(msg.size());
+            if (shm && !held.empty()) {
+                held.back().messages.emplace_back(msg);
+                return;
+            }
+            if (shm) {
+                shm->send(msg);
+                return;
+            }
+            char h[4];
+            if (!held.empty()) {
+                // it goes out after the logged write before it
+                string &a = held.back().after;
+                a.append(h, framer.header(msg.size(), h));
+                a.append(msg);
+                a.append(framer.trailer());
+                return;
+            }
+            out.push(string_view(h, framer.header(msg.size(), h)));
+            out.push(msg);
+            out.push(framer.trailer());
+            if (!corked) {
+                flush();
+            }
+        }
+
+        // the oldest logged write is done, its reply and the ones held after it go out
+        void release(string_view msg)
+        {
+            Held r = move(held.front());
+            held.pop_front();
+            Metrics::local().bytesOut.add(msg.size());
+            if (shm) {
+                shm->send(msg);
+                for (auto &m : r.messages) {
+                    shm->send(m);
+                }
+                return;
+            }
+            char h[4];
+            out.push(string_view(h, framer.header(msg.size(), h)));
+            out.push(msg);
+            out.push(framer.trailer());
+            out.push(r.after);
+            if (!corked) {
+                flush();
+            }
+        }
+
+        // the next complete message from the client, a reply that went out before the client's
+        // framing was known gets the newline that ends its line first
+        bool next(string_view &msg)
+        {
+            bool got = framer.next(msg);
+            if (framer.closeLine()) {
+                if (!held.empty()) {
+                    held.back().after.push_back('\n');
+                }
+                else {
+                    out.push("\n");
+                    if (!corked) {
+                        flush();
+                    }
+                }
+            }
+            return got;
+        }
+
+        // send the output queue, called again by the server on EPOLLOUT until it is empty
+        // with io_uring it is only queued for the server's next submission batch
+        void flush()
+        {
+            if (failed) {
+                return;
+            }
+            if (shm) {
+                shm->flush();
+                return;
+            }
+            if (uring) {
+                if (!uring->queued && !out.empty()) {
+                    uring->queued = true;
+                    uring->sendQueue->push_back(this);
+                }
+                return;
+            }
+            int r = out.flush(fd);
+            if (r < 0) {
+                Metrics::local().errors.add();
+                LOG_WARN("Connection write error: %s", strerror(errno));
+                failed = closing = true;
+                return;
+            }
+            if ((r == 0) != writing) {
+                watch(r == 0);
+            }
+        }
+
+        // bytes of replies the client has not taken yet, for a shm client those waiting for
+        // room in its reply ring
+        size_t output() const
+        {
+            return shm ? shm->backlog() : out.size();
+        }
+
+        // close the connection after the pending replies are sent
+        void end()
+        {
+            closing = true;
+        }
+
+        // the server can release the connection
+        bool done() const
+        {
+            return failed || (closing && out.empty() && !awaiting && held.empty());
+        }
+};
+
+}
+
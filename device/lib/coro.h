@@ -0,0 +1,254 @@
+/*
+ * Source File: coro.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "connection.h"
+#include "log.h"
+#include "timerwheel.h"
+
+namespace Tcp {
+
+using namespace std;
+
+class Stream;
+
+// coroutine of one connection, the server starts it when the client connects and its event
+// loop resumes it, the connection closes once it returns and a coroutine whose client goes
+// away is destroyed where it waits, its locals are destroyed as usual
+//
+// s->onConnection([](Tcp::Stream &st) -> Tcp::Task {
+//     for (;;) {
+//         string msg = co_await st.readMessage();
+//         co_await st.write(msg);
+//     }
+// });
+class Task
+{
+    public:
+        struct promise_type
+        {
+            shared_ptr<Stream> stream;  // kept alive as long as the coroutine
+
+            Task get_return_object()
+            {
+                return Task{coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            // the server hands over the stream before it runs
+            suspend_always initial_suspend() noexcept { return {}; }
+            suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            inline void unhandled_exception();
+            inline ~promise_type();
+        };
+
+        coroutine_handle<promise_type> handle;
+};
+
+// reactor mode callback that runs a connection as a coroutine, see Server::onConnection()
+using StreamHandler = function<Task(Stream&)>;
+
+// the awaitable side of a reactor connection, only used on its event loop thread
+// while the coroutine is not waiting in readMessage() the connection is not read, requests
+// wait in the socket the same way they do for a client over its limits
+class Stream : public enable_shared_from_this<Stream>
+{
+    enum class Wait
+    {
+        None,
+        Read,
+        Write,
+        Sleep
+    };
+
+    Connection *c;
+    vector<shared_ptr<Stream>> &ready;  // the server's list of streams to resume
+    TimerWheel &timers;
+    Timer timer;                        // of sleepFor()
+    coroutine_handle<> waiter;
+    Wait wait = Wait::None;
+    string message;
+    bool finished = false;
+
+    // the event loop resumes the coroutine, not whatever noticed that its wait is over
+    void wake()
+    {
+        ready.push_back(shared_from_this());
+    }
+
+    struct ReadAwaiter
+    {
+        Stream &s;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h)
+        {
+            s.waiter = h;
+            s.wait = Wait::Read;
+            // the server may hand it the next request now
+            s.c->awaiting = false;
+        }
+        string await_resume()
+        {
+            return move(s.message);
+        }
+    };
+
+    struct WriteAwaiter
+    {
+        Stream &s;
+        bool await_ready() const noexcept { return s.c->out.empty(); }
+        void await_suspend(coroutine_handle<> h)
+        {
+            s.waiter = h;
+            s.wait = Wait::Write;
+        }
+        void await_resume() const {}
+    };
+
+    struct SleepAwaiter
+    {
+        Stream &s;
+        int ms;
+        bool await_ready() const noexcept { return ms <= 0; }
+        void await_suspend(coroutine_handle<> h)
+        {
+            s.waiter = h;
+            s.wait = Wait::Sleep;
+            s.timers.schedule(s.timer, s.timers.now() + ms);
+        }
+        void await_resume() const {}
+    };
+
+    public:
+        Stream(Connection &conn, vector<shared_ptr<Stream>> &r, TimerWheel &t) : c{&conn}, ready{r}, timers{t}
+        {
+            timer.fire = [this] { wake(); };
+        }
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+
+        // the next message of the client
+        ReadAwaiter readMessage()
+        {
+            return ReadAwaiter{*this};
+        }
+
+        // send msg framed the way the client frames its requests, resumes once the socket took it
+        WriteAwaiter write(string_view msg)
+        {
+            c->write(msg);
+            return WriteAwaiter{*this};
+        }
+
+        // resume after ms, on the event loop's timer wheel
+        SleepAwaiter sleepFor(int ms)
+        {
+            return SleepAwaiter{*this, ms};
+        }
+
+        Connection &connection() const
+        {
+            return *c;
+        }
+
+        // server side
+
+        // run the coroutine until its first co_await
+        void start(Task t)
+        {
+            c->awaiting = true;
+            t.handle.promise().stream = shared_from_this();
+            t.handle.resume();
+        }
+
+        // a request for the coroutine waiting in readMessage(), dropped once it has returned
+        void deliver(string_view msg)
+        {
+            if (finished || wait != Wait::Read) {
+                return;
+            }
+            message.assign(msg);
+            c->awaiting = true;
+            wait = Wait::None;
+            exchange(waiter, nullptr).resume();
+        }
+
+        // the output queue may have drained
+        void drained()
+        {
+            if (wait == Wait::Write && c->out.empty()) {
+                wake();
+            }
+        }
+
+        // resume the coroutine if what it waits for is done
+        void run()
+        {
+            if (!waiter || wait == Wait::Read || (wait == Wait::Write && !c->out.empty()) ||
+                (wait == Wait::Sleep && timer.armed())) {
+                return;
+            }
+            wait = Wait::None;
+            exchange(waiter, nullptr).resume();
+        }
+
+        // the connection is going away, so does a coroutine still waiting
+        void close()
+        {
+            c = nullptr;
+            timers.cancel(timer);
+            if (waiter) {
+                exchange(waiter, nullptr).destroy();
+            }
+        }
+
+        bool closed() const
+        {
+            return c == nullptr;
+        }
+
+        // the coroutine returned, the connection closes after its replies
+        void finish()
+        {
+            finished = true;
+            waiter = nullptr;
+            if (c) {
+                c->awaiting = false;
+                c->end();
+                wake();
+            }
+        }
+};
+
+void Task::promise_type::unhandled_exception()
+{
+    try
+    {
+        throw;
+    }
+    catch (exception& e)
+    {
+        LOG_ERROR("connection coroutine error: %s", e.what());
+    }
+    if (stream && !stream->closed()) {
+        stream->connection().failed = true;
+    }
+}
+
+Task::promise_type::~promise_type()
+{
+    if (stream) {
+        stream->finish();
+    }
+}
+
+}
@@ -0,0 +1,223 @@
+/*
+ * Source File: executor.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Tcp {
+
+using namespace std;
+
+// fixed pool of threads for handlers that block, e.g. a slow sensor read, so the event loops
+// keep serving everyone else, each thread has its own queue and takes work from the others
+// when it runs dry
+class Executor
+{
+    struct Queue
+    {
+        mutex lock;
+        deque<function<void()>> jobs;
+    };
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> threads;
+    atomic<size_t> next{0};     // round robin over the queues for submitters outside the pool
+    atomic<size_t> queued{0};
+    mutex sleepLock;
+    condition_variable wake;
+    bool stopped = false;
+
+    static int &self()
+    {
+        thread_local int k = -1;    // queue of the calling pool thread
+        return k;
+    }
+
+    // the oldest job of its own queue, else the newest of another one
+    bool take(size_t k, function<void()> &job)
+    {
+        for (size_t n = 0; n < queues.size(); n++) {
+            Queue &q = *queues[(k + n) % queues.size()];
+            lock_guard<mutex> g(q.lock);
+            if (q.jobs.empty()) {
+                continue;
+            }
+            if (n == 0) {
+                job = move(q.jobs.front());
+                q.jobs.pop_front();
+            }
+            else {
+                job = move(q.jobs.back());
+                q.jobs.pop_back();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t k)
+    {
+        self() = int(k);
+        function<void()> job;
+        for (;;) {
+            if (take(k, job)) {
+                job();
+                job = nullptr;
+                continue;
+            }
+            unique_lock<mutex> g(sleepLock);
+            wake.wait(g, [this] { return stopped || queued.load() > 0; });
+            if (stopped && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    public:
+        explicit Executor(unsigned n = 4)
+        {
+            n = max(n, 1u);
+            for (unsigned k = 0; k < n; k++) {
+                queues.push_back(make_unique<Queue>());
+            }
+            for (unsigned k = 0; k < n; k++) {
+                threads.emplace_back([this, k] { run(k); });
+            }
+        }
+        Executor(const Executor&) = delete;
+        Executor& operator=(const Executor&) = delete;
+
+        // runs the jobs still queued, then joins the threads
+        ~Executor()
+        {
+            {
+                lock_guard<mutex> g(sleepLock);
+                stopped = true;
+            }
+            wake.notify_all();
+            for (auto &t : threads) {
+                t.join();
+            }
+        }
+
+        // pool shared by all routes that do not name their own, one thread per core
+        static Executor &shared()
+        {
+            static Executor pool(max(4u, thread::hardware_concurrency()));
+            return pool;
+        }
+
+        size_t size() const
+        {
+            return threads.size();
+        }
+
+        // queue job on the calling pool thread's own queue, or round robin from outside the pool
+        void submit(function<void()> job)
+        {
+            size_t k = self() >= 0 ? size_t(self()) : next++ % queues.size();
+            {
+                lock_guard<mutex> g(queues[k]->lock);
+                queues[k]->jobs.push_back(move(job));
+            }
+            queued++;
+            {
+                lock_guard<mutex> g(sleepLock);
+            }
+            wake.notify_one();
+        }
+};
+
+// reply of a job that ran on an Executor, for the connection identified by fd and id
+struct Completion
+{
+    Completion *next = nullptr;
+    int fd;
+    uint64_t conn;
+    shared_ptr<const string> reply;     // shared by every connection waiting for the same read
+    bool release = false;   // a logged write is done, reply goes out before the ones held behind it
+};
+
+// completions of one event loop, pushed by any thread without a lock and taken by the loop
+// after the eventfd it shares with the loop woke it up
+class CompletionQueue
+{
+    atomic<Completion *> head{nullptr};
+    atomic<bool> signaled{false};
+    atomic<int> outstanding{0};
+    int wakefd;
+
+    public:
+        explicit CompletionQueue(int fd) : wakefd{fd} {}
+        CompletionQueue(const CompletionQueue&) = delete;
+        CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+        // the jobs still running hold a pointer to the queue, wait for them
+        ~CompletionQueue()
+        {
+            while (outstanding.load() > 0) {
+                this_thread::yield();
+            }
+            for (Completion *c = take(); c;) {
+                Completion *n = c->next;
+                delete c;
+                c = n;
+            }
+        }
+
+        // a job for this loop was submitted, it must push() exactly once
+        void expect()
+        {
+            outstanding++;
+        }
+
+        // the job expected could not be submitted after all, it will not push()
+        void abandon()
+        {
+            outstanding--;
+        }
+
+        void push(Completion *c)
+        {
+            c->next = head.load(memory_order_relaxed);
+            while (!head.compare_exchange_weak(c->next, c, memory_order_release, memory_order_relaxed)) {}
+            if (!signaled.exchange(true)) {
+                uint64_t one = 1;
+                ::write(wakefd, &one, sizeof(one));
+            }
+            outstanding--;
+        }
+
+        // everything pushed so far, oldest first, the caller deletes the completions
+        Completion *take()
+        {
+            if (!head.load(memory_order_relaxed)) {
+                return nullptr;
+            }
+            signaled.store(false);
+            Completion *c = head.exchange(nullptr, memory_order_acquire), *fifo = nullptr;
+            while (c) {
+                Completion *n = c->next;
+                c->next = fifo;
+                fifo = c;
+                c = n;
+            }
+            return fifo;
+        }
+};
+
+}
@@ -0,0 +1,357 @@
+/*
+ * Source File: framing.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <errno.h>
+#include <sys/socket.h>
+#include "socketerror.h"
+
+#define MAX_FRAME       (16 * 1024 * 1024)
+#define FILL_SIZE       16384
+
+namespace Tcp {
+
+using namespace std;
+
+enum class Framing
+{
+    Raw,        // whatever was received so far is one message (legacy behaviour)
+    Newline,    // messages end with '\n', an optional '\r' before it is dropped, never picked by Auto
+    Length,     // 4 byte big-endian length followed by the message bytes
+    Json,       // one complete json object or array per message, whitespace/newlines in between are skipped
+    Auto        // pick Length, Json or Raw from the first byte the peer sends
+};
+
+// a newline delimited json (NDJSON) peer is framed as Json, its replies end with a newline
+// once the byte after its first message shows it ends them with one
+
+// how message bodies are encoded, json text unless the client negotiates a binary encoding
+// with a {"method":"node-edge-hello", "encoding":"cbor"} or "msgpack" first message
+enum class Encoding
+{
+    Json,
+    Cbor,
+    MsgPack
+};
+
+// growable input buffer that extracts complete messages as bytes arrive
+class Framer
+{
+    Framing mode;
+    size_t maxFrame;
+    string buf;
+    size_t head = 0;            // start of the first unconsumed byte in buf
+    size_t scan = 0;            // json scanner position relative to head
+    int depth = 0;
+    bool quoted = false, escaped = false;
+    bool delimited = false;     // json peer terminates its messages with a newline
+    bool decided = false;       // delimited is known, from the first byte after a message
+    bool framed = false;        // a json message was taken from the buffer
+    bool open = false;          // a reply went out before it was known, its line is not ended
+
+    void consume(size_t n)
+    {
+        head += n;
+        scan = 0;
+    }
+
+    void detect()
+    {
+        while (head < buf.size() && isspace(static_cast<unsigned char>(buf[head]))) {
+            head++;
+        }
+        if (head == buf.size()) {
+            return;
+        }
+        char c = buf[head];
+        mode = c == '\0' ? Framing::Length : (c == '{' || c == '[') ? Framing::Json : Framing::Raw;
+    }
+
+    bool nextLine(string_view &msg)
+    {
+        for (;;) {
+            size_t pos = buf.find('\n', head + scan);
+            if (pos == string::npos) {
+                scan = buf.size() - head;
+                if (scan > maxFrame) {
+                    throw SocketError("message exceeds the maximum frame size");
+                }
+                return false;
+            }
+            size_t len = pos - head;
+            if (len > 0 && buf[head + len - 1] == '\r') {
+                len--;
+            }
+            msg = string_view(buf.data() + head, len);
+            consume(pos - head + 1);
+            if (!msg.empty()) {
+                return true;
+            }
+        }
+    }
+
+    bool nextLength(string_view &msg)
+    {
+        if (buf.size() - head < 4) {
+            return false;
+        }
+        auto p = reinterpret_cast<const unsigned char *>(buf.data() + head);
+        size_t len = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | size_t(p[3]);
+        if (len > maxFrame) {
+            throw SocketError("message exceeds the maximum frame size");
+        }
+        if (buf.size() - head < 4 + len) {
+            return false;
+        }
+        msg = string_view(buf.data() + head + 4, len);
+        consume(4 + len);
+        return true;
+    }
+
+    // whether the peer ends its messages with a newline, from the bytes after one at i,
+    // undecided while only blanks follow
+    void decide(size_t i)
+    {
+        while (!decided && i < buf.size()) {
+            char c = buf[i++];
+            if (c == '\n' || c == '\r') {
+                delimited = decided = true;
+            }
+            else if (c != ' ' && c != '\t') {
+                decided = true;
+            }
+        }
+    }
+
+    bool nextJson(string_view &msg)
+    {
+        if (scan == 0) {
+            if (framed) {
+                decide(head);
+            }
+            while (head < buf.size() && isspace(static_cast<unsigned char>(buf[head]))) {
+                head++;
+            }
+            if (head == buf.size()) {
+                return false;
+            }
+        }
+        // resume the scan where the previous call stopped so every byte is looked at once
+        for (size_t i = head + scan; i < buf.size(); i++) {
+            char c = buf[i];
+            if (quoted) {
+                if (escaped) {
+                    escaped = false;
+                }
+                else if (c == '\\') {
+                    escaped = true;
+                }
+                else if (c == '"') {
+                    quoted = false;
+                }
+                continue;
+            }
+            if (c == '"') {
+                quoted = true;
+            }
+            else if (c == '{' || c == '[') {
+                depth++;
+            }
+            else if (c == '}' || c == ']') {
+                if (--depth <= 0) {
+                    depth = 0;
+                    msg = string_view(buf.data() + head, i + 1 - head);
+                    framed = true;
+                    decide(i + 1);
+                    consume(i + 1 - head);
+                    return true;
+                }
+            }
+            else if (depth == 0) {
+                // not a json document, hand the rest to the application as it is
+                msg = string_view(buf.data() + head, buf.size() - head);
+                consume(buf.size() - head);
+                return true;
+            }
+        }
+        scan = buf.size() - head;
+        if (scan > maxFrame) {
+            throw SocketError("message exceeds the maximum frame size");
+        }
+        return false;
+    }
+
+    public:
+        Framer(Framing m = Framing::Auto, size_t max = MAX_FRAME) : mode{m}, maxFrame{max} {}
+
+        Framing framing() const
+        {
+            return mode;
+        }
+
+        void setFraming(Framing m)
+        {
+            mode = m;
+        }
+
+        // json peer ends its messages with a newline, kept when a connection changes hands
+        bool newlines() const
+        {
+            return delimited;
+        }
+
+        void setNewlines(bool on)
+        {
+            delimited = decided = on;
+        }
+
+        // true once if the peer turned out to end its messages with a newline after a reply
+        // went out without one, the caller sends the newline that ends its line
+        bool closeLine()
+        {
+            if (!open || !decided) {
+                return false;
+            }
+            open = false;
+            return delimited;
+        }
+
+        // number of received bytes not yet returned as a message
+        size_t pending() const
+        {
+            return buf.size() - head;
+        }
+
+        void append(const char *data, size_t n)
+        {
+            // drop consumed messages once they dominate the buffer, no message view is alive here
+            if (head == buf.size()) {
+                buf.clear();
+                head = 0;
+            }
+            else if (head > 4096 && head * 2 > buf.size()) {
+                buf.erase(0, head);
+                head = 0;
+            }
+            buf.append(data, n);
+        }
+
+        // receive everything available on fd without blocking
+        // returns 1 once the socket would block, 0 if the peer closed it and -1 on a socket error
+        int fill(int fd)
+        {
+            char buffer[FILL_SIZE];
+            for (;;) {
+                ssize_t n{recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)};
+                if (n > 0) {
+                    append(buffer, n);
+                    continue;
+                }
+                if (n == 0) {
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+            }
+        }
+
+        // get the next complete message, false if more bytes are needed
+        // msg stays valid until the next call to append()
+        bool next(string_view &msg)
+        {
+            if (mode == Framing::Auto) {
+                detect();
+                if (mode == Framing::Auto) {
+                    return false;
+                }
+            }
+            switch (mode) {
+                case Framing::Newline:
+                    return nextLine(msg);
+                case Framing::Length:
+                    return nextLength(msg);
+                case Framing::Json:
+                    return nextJson(msg);
+                default:
+                    if (head == buf.size()) {
+                        return false;
+                    }
+                    msg = string_view(buf.data() + head, buf.size() - head);
+                    consume(buf.size() - head);
+                    return true;
+            }
+        }
+
+        // the bytes that go before and after an outgoing message of n bytes, written without
+        // copying the message, header holds up to 4 bytes and returns how many it used
+        // a json reply that goes out before the peer's delimiting is known has no trailer, the
+        // one after it starts on a new line, a json parser skips the newline either way
+        size_t header(size_t n, char *h)
+        {
+            if (mode == Framing::Json && !decided && open) {
+                h[0] = '\n';
+                return 1;
+            }
+            if (mode != Framing::Length) {
+                return 0;
+            }
+            h[0] = char((n >> 24) & 0xff);
+            h[1] = char((n >> 16) & 0xff);
+            h[2] = char((n >> 8) & 0xff);
+            h[3] = char(n & 0xff);
+            return 4;
+        }
+
+        string_view trailer()
+        {
+            if (mode == Framing::Json && !decided) {
+                open = true;
+                return "";
+            }
+            return mode == Framing::Newline || (mode == Framing::Json && delimited) ? "\n" : "";
+        }
+
+        // encode an outgoing message the same way the peer frames its messages
+        string frame(string_view msg) const
+        {
+            string out;
+            switch (mode) {
+                case Framing::Length:
+                    out.reserve(4 + msg.size());
+                    out.push_back(char((msg.size() >> 24) & 0xff));
+                    out.push_back(char((msg.size() >> 16) & 0xff));
+                    out.push_back(char((msg.size() >> 8) & 0xff));
+                    out.push_back(char(msg.size() & 0xff));
+                    out.append(msg);
+                    break;
+                case Framing::Newline:
+                    out.reserve(msg.size() + 1);
+                    out.append(msg);
+                    out.push_back('\n');
+                    break;
+                case Framing::Json:
+                    out.reserve(msg.size() + 1);
+                    out.append(msg);
+                    if (delimited) {
+                        out.push_back('\n');
+                    }
+                    break;
+                default:
+                    out.append(msg);
+            }
+            return out;
+        }
+};
+
+}
+
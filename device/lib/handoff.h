@@ -0,0 +1,429 @@
+/*
+ * Source File: handoff.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framing.h"
+#include "log.h"
+#include "socketerror.h"
+#include "unixsocket.h"
+
+#define HANDOFF_DRAIN       5000    // default ms a draining server waits for its connections to go quiet
+#define HANDOFF_WAIT        60000   // ms a new instance waits for the one it takes over from
+
+namespace Tcp {
+
+using namespace std;
+
+// a live client connection passed from a restarting server to the next instance, it goes
+// on with the framing and encoding it had
+struct HandedConnection
+{
+    int fd;
+    Framing framing = Framing::Auto;
+    bool delimited = false;     // json peer ends its messages with a newline
+    Encoding encoding = Encoding::Json;
+    bool negotiated = false;    // past its first message, see Router hello
+    bool accepted = false;      // accepted by take() while the previous instance drained, not checked by a server yet
+};
+
+// what a new instance got from the one before it, see HandOff::take()
+struct Inherited
+{
+    vector<int> listeners;
+    vector<HandedConnection> connections;
+};
+
+// listening sockets passed by systemd socket activation, LISTEN_FDS sockets from fd 3 on,
+// empty if the process was not started that way
+inline vector<int> listenFds()
+{
+    vector<int> fds;
+    const char *pid = getenv("LISTEN_PID"), *n = getenv("LISTEN_FDS");
+    if (!pid || !n || strtol(pid, nullptr, 10) != getpid()) {
+        return fds;
+    }
+    for (int fd = 3; fd < 3 + atoi(n); fd++) {
+        int type = 0, listening = 0;
+        socklen_t len = sizeof(int);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM ||
+            getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening) {
+            LOG_WARN("inherited fd %d is not a listening stream socket, ignored", fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fds.push_back(fd);
+    }
+    // children of the server do not take them for their own
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return fds;
+}
+
+// hot restart, a running server waits on a unix socket for the next instance of itself
+//
+// the new instance connects with take() before it binds anything, the running one passes its
+// listening sockets with SCM_RIGHTS right away and stops accepting, take() accepts on them from
+// then on, the running one drains its connections and passes each one it keeps as soon as it
+// is quiet, take() returns once the running one has stopped and closed its write log
+// both ends only deal with a peer of the same uid
+//
+// Tcp::Inherited in = Tcp::HandOff::take("edge-handoff");
+// ...
+// Tcp::HandOff h("edge-handoff", [&s] { return s->listeners(); }, [&s](auto keep) { s->drain(keep); });
+// s->run();
+// h.finish();
+class HandOff
+{
+    // one batch of fds and what they are, sendFds() passes up to 8 at a time
+    struct Record
+    {
+        uint8_t kind;           // Kind
+        uint8_t framing;
+        uint8_t delimited;
+        uint8_t encoding;
+        uint8_t negotiated;
+    };
+
+    enum End : uint8_t
+    {
+        More,
+        Listeners,              // the last batch of listening sockets, connections follow
+        Done                    // the last batch, the running instance has stopped
+    };
+
+    struct Batch
+    {
+        uint8_t n = 0;
+        uint8_t end = More;     // End
+        Record r[8];
+    };
+
+    enum Kind : uint8_t
+    {
+        Listener,
+        Client
+    };
+
+    string path;
+    int sock = -1;              // listening for the next instance
+    int taker = -1;             // the next instance, once it connected
+    int stopfd = -1;
+    thread waiter;
+    mutex lock;
+    size_t handed = 0;          // connections passed to the taker
+
+    static bool send(int fd, Batch &b, const int *fds)
+    {
+        bool ok = sendFds(fd, fds, b.n, &b, sizeof(b));
+        b.n = 0;
+        return ok;
+    }
+
+    // the taker went away, the connections kept from now on are closed
+    void lost()
+    {
+        LOG_ERROR("handoff error: %s", strerror(errno));
+        close(taker);
+        taker = -1;
+    }
+
+    // pass the listening sockets, false if the taker could not take them
+    bool lend(const vector<int> &listeners)
+    {
+        lock_guard<mutex> g(lock);
+        Batch b;
+        int fds[8];
+        bool ok = true;
+        for (int fd : listeners) {
+            fds[b.n] = fd;
+            b.r[b.n++] = Record{Listener, 0, 0, 0, 0};
+            if (b.n == 8) {
+                ok = ok && send(taker, b, fds);
+            }
+        }
+        b.end = Listeners;
+        ok = ok && send(taker, b, fds);
+        if (!ok) {
+            lost();
+            return false;
+        }
+        LOG_INFO("handed over %zu listener(s)", listeners.size());
+        return true;
+    }
+
+    // wait for the next instance, pass it the listening sockets and start draining through
+    // onTaker once it has them
+    void wait(function<vector<int>()> listeners, function<void(function<void(const HandedConnection&)>)> onTaker)
+    {
+        pollfd p[2] = {{sock, POLLIN, 0}, {stopfd, POLLIN, 0}};
+        for (;;) {
+            if (poll(p, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("handoff error: %s", strerror(errno));
+                return;
+            }
+            if (p[1].revents) {
+                return;
+            }
+            int fd = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            ucred cred;
+            if (!peerCredentials(fd, cred) || cred.uid != geteuid()) {
+                LOG_WARN("handoff peer pid %d uid %u rejected", int(cred.pid), unsigned(cred.uid));
+                close(fd);
+                continue;
+            }
+            LOG_INFO("handing over to pid %d", int(cred.pid));
+            // one taker, the next instance waits here for the one after it
+            {
+                lock_guard<mutex> g(lock);
+                taker = fd;
+            }
+            unlisten();
+            // the next instance accepts from here on, the loops stop accepting in drain
+            if (lend(listeners())) {
+                onTaker([this](const HandedConnection &h) { keep(h); });
+            }
+            return;
+        }
+    }
+
+    // accept the clients waiting on the listening socket l, the server they are passed to
+    // checks them like its own
+    static void accepting(int l, Inherited &in)
+    {
+        for (;;) {
+            int c = accept4(l, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (c >= 0) {
+                in.connections.push_back(HandedConnection{c, Framing::Auto, false, Encoding::Json, false, true});
+            }
+            else if (errno != EINTR && errno != ECONNABORTED) {
+                return;
+            }
+        }
+    }
+
+    void unlisten()
+    {
+        if (sock >= 0) {
+            close(sock);
+            sock = -1;
+            if (path[0] != '@') {
+                unlink(path.c_str());
+            }
+        }
+    }
+
+    public:
+        // listen on path, a socket file or "@name" for the abstract namespace, when the next
+        // instance connects the sockets from listeners are passed to it and onTaker is called on a
+        // thread of its own with the function that keeps a drained connection for it, e.g. to
+        // pass to ShardedServer::drain()
+        HandOff(const string &Path, function<vector<int>()> listeners,
+                function<void(function<void(const HandedConnection&)>)> onTaker) : path{Path}
+        {
+            sockaddr_un addr;
+            socklen_t len = unixAddress(path, addr);
+            sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if (sock < 0) {
+                throw SocketError();
+            }
+            if (path[0] != '@') {
+                // take() found nobody there, the file is left from a crash
+                unlink(path.c_str());
+            }
+            if (bind(sock, (struct sockaddr *)&addr, len) < 0 || listen(sock, 1) < 0) {
+                int e = errno;
+                close(sock);
+                errno = e;
+                throw SocketError();
+            }
+            stopfd = eventfd(0, EFD_CLOEXEC);
+            waiter = thread([this, l = move(listeners), f = move(onTaker)] { wait(l, f); });
+        }
+        HandOff(const HandOff&) = delete;
+        HandOff& operator=(const HandOff&) = delete;
+        ~HandOff()
+        {
+            uint64_t one = 1;
+            ::write(stopfd, &one, sizeof(one));
+            if (waiter.joinable()) {
+                waiter.join();
+            }
+            close(stopfd);
+            unlisten();
+            if (taker >= 0) {
+                close(taker);
+            }
+        }
+
+        // the next instance connected, the server is draining for it
+        bool requested()
+        {
+            lock_guard<mutex> g(lock);
+            return taker >= 0;
+        }
+
+        // pass a connection the server let go of to the next instance right away, it is closed
+        // here either way, thread safe
+        void keep(const HandedConnection &h)
+        {
+            lock_guard<mutex> g(lock);
+            if (taker >= 0) {
+                Batch b;
+                b.r[b.n++] = Record{Client, uint8_t(h.framing), h.delimited, uint8_t(h.encoding), h.negotiated};
+                if (send(taker, b, &h.fd)) {
+                    handed++;
+                }
+                else {
+                    lost();
+                }
+            }
+            // the next instance has its own copy now
+            close(h.fd);
+        }
+
+        // tell the next instance that this one is done, call it once the server has stopped
+        // and closed its write log, false if none took over or it went away
+        bool finish()
+        {
+            lock_guard<mutex> g(lock);
+            if (taker < 0) {
+                return false;
+            }
+            Batch b;
+            b.end = Done;
+            if (!send(taker, b, nullptr)) {
+                lost();
+                return false;
+            }
+            LOG_INFO("handed over %zu connection(s)", handed);
+            close(taker);
+            taker = -1;
+            return true;
+        }
+
+        // take over from the instance waiting on path, the result is empty when none is running
+        // or it is not of the same uid, a stale socket file is left for the HandOff constructor
+        // clients of the listening sockets it passes are accepted here while it drains, this
+        // blocks until it has stopped, so the write log is not opened twice
+        static Inherited take(const string &path, int ms = HANDOFF_WAIT)
+        {
+            Inherited in;
+            sockaddr_un addr;
+            socklen_t len = unixAddress(path, addr);
+            int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                throw SocketError();
+            }
+            if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+                close(fd);
+                return in;
+            }
+            // whoever bound the path first could pass any socket, only trust our own instance
+            ucred cred;
+            if (!peerCredentials(fd, cred) || cred.uid != geteuid()) {
+                LOG_WARN("handoff peer pid %d uid %u rejected", int(cred.pid), unsigned(cred.uid));
+                close(fd);
+                return in;
+            }
+
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+            bool listening = false;
+            for (;;) {
+                vector<pollfd> p{{fd, POLLIN, 0}};
+                if (listening) {
+                    for (int l : in.listeners) {
+                        p.push_back({l, POLLIN, 0});
+                    }
+                }
+                auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                int n = left > 0 ? poll(p.data(), p.size(), int(left)) : 0;
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                for (size_t k = 1; n > 0 && k < p.size(); k++) {
+                    if (p[k].revents & POLLIN) {
+                        accepting(p[k].fd, in);
+                    }
+                }
+
+                int got = -1;
+                Batch b;
+                int fds[8];
+                if (n > 0 && p[0].revents) {
+                    errno = 0;
+                    got = recvFds(fd, fds, 8, &b, sizeof(b));
+                }
+                else if (n > 0) {
+                    continue;
+                }
+                if (got < 0) {
+                    int e = n == 0 ? ETIMEDOUT : errno;
+                    close(fd);
+                    if (listening && e != ETIMEDOUT) {
+                        // it went away after passing its sockets, they are good to go on with
+                        LOG_WARN("handoff incomplete, the running instance went away");
+                        return in;
+                    }
+                    // the old instance went away or hangs, nothing it sent so far is of use
+                    for (int l : in.listeners) {
+                        close(l);
+                    }
+                    for (auto &h : in.connections) {
+                        close(h.fd);
+                    }
+                    if (e == ETIMEDOUT) {
+                        throw SocketError("handoff timed out, the running instance did not hand over");
+                    }
+                    LOG_WARN("handoff incomplete, the running instance went away");
+                    return Inherited{};
+                }
+                for (int k = 0; k < got; k++) {
+                    const Record &r = b.r[k];
+                    if (k >= b.n) {
+                        close(fds[k]);
+                    }
+                    else if (r.kind == Listener) {
+                        // accepting() must not block when the running instance took the client first
+                        fcntl(fds[k], F_SETFL, fcntl(fds[k], F_GETFL, 0) | O_NONBLOCK);
+                        in.listeners.push_back(fds[k]);
+                    }
+                    else {
+                        in.connections.push_back(HandedConnection{fds[k], Framing(r.framing), r.delimited != 0, Encoding(r.encoding), r.negotiated != 0});
+                    }
+                }
+                listening = listening || b.end == Listeners;
+                if (b.end == Done) {
+                    break;
+                }
+            }
+            close(fd);
+            return in;
+        }
+};
+
+}
@@ -0,0 +1,271 @@
+/*
+ * Source File: log.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define LOG_LINE        256     // bytes per record, longer messages are cut
+#define LOG_SLOTS       4096    // records per thread ring, a power of two
+#define LOG_BURST       20      // messages per call site, thread and second before the rate limiter kicks in
+
+// call sites below this level compile to nothing, 0 trace, 1 debug, 2 info, 3 warn, 4 error
+#ifndef EDGE_LOG_LEVEL
+#define EDGE_LOG_LEVEL  1
+#endif
+
+namespace Tcp {
+
+using namespace std;
+
+enum class LogLevel
+{
+    Trace,
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off
+};
+
+// per call site and thread rate limiter, after LOG_BURST messages in one second the rest of
+// that second is counted and reported with the next message that gets through, it caps every
+// message of the call site, whatever its text
+struct LogLimit
+{
+    int64_t second = 0;
+    uint32_t count = 0;
+    uint32_t dropped = 0;
+
+    // true if the message may be logged, suppressed is the number dropped before it
+    bool allow(uint32_t &suppressed)
+    {
+        int64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        if (second != now) {
+            second = now;
+            count = 0;
+        }
+        if (count++ >= LOG_BURST) {
+            dropped++;
+            return false;
+        }
+        suppressed = exchange(dropped, 0);
+        return true;
+    }
+};
+
+// asynchronous logger, every thread formats its messages into its own lock-free ring
+// and a background thread writes them out, nothing on the calling thread blocks or flushes
+//
+// use the LOG_TRACE ... LOG_ERROR macros with printf style arguments
+// LOG_DEBUG("read json string result: %s", r.c_str());
+class Log
+{
+    struct Record
+    {
+        int64_t time;       // realtime ns
+        LogLevel level;
+        uint16_t len;
+        char text[LOG_LINE - 16];
+    };
+
+    // single producer (the owning thread), single consumer (the writer thread)
+    struct Ring
+    {
+        alignas(64) atomic<uint64_t> head{0};
+        alignas(64) atomic<uint64_t> tail{0};
+        atomic<uint64_t> lost{0};  // records dropped because the ring was full
+        Record slots[LOG_SLOTS];
+    };
+
+    static inline atomic<int> level{int(LogLevel::Info)};
+    static inline atomic<bool> verbose{false};
+    static inline mutex lock;  // guards rings and the writer start/stop
+    static inline vector<shared_ptr<Ring>> rings;
+    static inline thread writer;
+    static inline atomic<bool> running{false};
+    static inline mutex consumer;  // the writer thread and flush() take turns draining the rings
+
+    static Ring &local()
+    {
+        thread_local Ring *r = [] {
+            auto p = make_shared<Ring>();
+            lock_guard<mutex> g(lock);
+            rings.push_back(p);
+            if (!running.exchange(true)) {
+                writer = thread(drainLoop);
+                static Stopper stopper; // drains and joins at exit
+            }
+            return p.get();
+        }();
+        return *r;
+    }
+
+    struct Stopper
+    {
+        ~Stopper()
+        {
+            running = false;
+            if (writer.joinable()) {
+                writer.join();
+            }
+            drain();
+        }
+    };
+
+    static void emit(FILE *out, const Record &rec)
+    {
+        if (verbose.load(memory_order_relaxed)) {
+            static const char *names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+            time_t sec = rec.time / 1000000000;
+            tm t;
+            localtime_r(&sec, &t);
+            fprintf(out, "%02d:%02d:%02d.%03d %-5s ", t.tm_hour, t.tm_min, t.tm_sec, int(rec.time / 1000000 % 1000), names[int(rec.level)]);
+        }
+        fwrite(rec.text, 1, rec.len, out);
+        fputc('\n', out);
+    }
+
+    // write out everything queued so far, one flush per batch
+    static void drain()
+    {
+        lock_guard<mutex> c(consumer);
+        vector<shared_ptr<Ring>> all;
+        {
+            lock_guard<mutex> g(lock);
+            all = rings;
+        }
+        for (auto &r : all) {
+            uint64_t head = r->head.load(memory_order_relaxed);
+            uint64_t tail = r->tail.load(memory_order_acquire);
+            for (; head != tail; head++) {
+                const Record &rec = r->slots[head & (LOG_SLOTS - 1)];
+                emit(rec.level >= LogLevel::Warn ? stderr : stdout, rec);
+            }
+            r->head.store(head, memory_order_release);
+            if (uint64_t n = r->lost.exchange(0, memory_order_relaxed)) {
+                fprintf(stderr, "log: %llu messages lost, ring full\n", (unsigned long long)n);
+            }
+        }
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    static void drainLoop()
+    {
+        while (running) {
+            drain();
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    }
+
+    public:
+        // messages below l are skipped at run time, EDGE_LOG_LEVEL removes them at compile time
+        static void setLevel(LogLevel l)
+        {
+            level.store(int(l), memory_order_relaxed);
+        }
+
+        static bool enabled(LogLevel l)
+        {
+            return int(l) >= level.load(memory_order_relaxed);
+        }
+
+        // prefix every line with the time and the level
+        static void setVerbose(bool yes)
+        {
+            verbose = yes;
+        }
+
+        // format into the next slot of the calling thread's ring, dropped if the ring is full
+        __attribute__((format(printf, 3, 4)))
+        static void write(LogLevel l, uint32_t suppressed, const char *fmt, ...)
+        {
+            Ring &r = local();
+            uint64_t tail = r.tail.load(memory_order_relaxed);
+            if (tail - r.head.load(memory_order_acquire) >= LOG_SLOTS) {
+                r.lost.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            Record &rec = r.slots[tail & (LOG_SLOTS - 1)];
+            rec.time = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+            rec.level = l;
+
+            int n = 0;
+            if (suppressed) {
+                n = snprintf(rec.text, sizeof(rec.text), "(%u messages suppressed) ", suppressed);
+            }
+            va_list ap;
+            va_start(ap, fmt);
+            int m = vsnprintf(rec.text + n, sizeof(rec.text) - n, fmt, ap);
+            va_end(ap);
+            size_t len = n + (m < 0 ? 0 : m);
+            if (len >= sizeof(rec.text)) {
+                len = sizeof(rec.text) - 1;
+                memcpy(rec.text + len - 3, "...", 3);
+            }
+            rec.len = uint16_t(len);
+            r.tail.store(tail + 1, memory_order_release);
+        }
+
+        // write out what is queued now, e.g. before abort()
+        static void flush()
+        {
+            drain();
+        }
+};
+
+}
+
+#define EDGE_LOG(lvl, ...) do { \
+    if (Tcp::Log::enabled(lvl)) { \
+        static thread_local Tcp::LogLimit edgeLogLimit_; \
+        uint32_t edgeLogSuppressed_ = 0; \
+        if (edgeLogLimit_.allow(edgeLogSuppressed_)) { \
+            Tcp::Log::write(lvl, edgeLogSuppressed_, __VA_ARGS__); \
+        } \
+    } \
+} while (0)
+
+#if EDGE_LOG_LEVEL <= 0
+#define LOG_TRACE(...)  EDGE_LOG(Tcp::LogLevel::Trace, __VA_ARGS__)
+#else
+#define LOG_TRACE(...)  do {} while (0)
+#endif
+
+#if EDGE_LOG_LEVEL <= 1
+#define LOG_DEBUG(...)  EDGE_LOG(Tcp::LogLevel::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)  do {} while (0)
+#endif
+
+#if EDGE_LOG_LEVEL <= 2
+#define LOG_INFO(...)   EDGE_LOG(Tcp::LogLevel::Info, __VA_ARGS__)
+#else
+#define LOG_INFO(...)   do {} while (0)
+#endif
+
+#if EDGE_LOG_LEVEL <= 3
+#define LOG_WARN(...)   EDGE_LOG(Tcp::LogLevel::Warn, __VA_ARGS__)
+#else
+#define LOG_WARN(...)   do {} while (0)
+#endif
+
+#if EDGE_LOG_LEVEL <= 4
+#define LOG_ERROR(...)  EDGE_LOG(Tcp::LogLevel::Error, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)  do {} while (0)
+#endif
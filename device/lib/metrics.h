@@ -0,0 +1,340 @@
+/*
+ * Source File: metrics.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#define MAX_TOPICS      256     // topics with their own request counter, the rest share the last one
+#define HIST_SUB_BITS   4       // 16 buckets per power of two, about 6% resolution
+#define HIST_BUCKETS    ((36 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)  // up to 2^36 ns (68 s)
+
+namespace Tcp {
+
+using namespace std;
+using json = nlohmann::json;
+
+// counter with one writing thread, readers on other threads see a recent value
+// the increment is a plain load and store, no locked instruction on the request path
+struct Counter
+{
+    atomic<uint64_t> v{0};
+
+    void add(uint64_t n = 1)
+    {
+        v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return v.load(memory_order_relaxed);
+    }
+};
+
+// log-linear latency histogram in ns (HDR style), one writing thread
+class Histogram
+{
+    atomic<uint64_t> buckets[HIST_BUCKETS] = {};
+    Counter total, sum;
+    atomic<uint64_t> top{0};
+
+    static int index(uint64_t v)
+    {
+        if (v < (1u << HIST_SUB_BITS)) {
+            return int(v);
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int idx = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + int((v >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+        return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+    }
+
+    public:
+        // smallest value of bucket idx
+        static uint64_t lower(int idx)
+        {
+            if (idx < (1 << HIST_SUB_BITS)) {
+                return idx;
+            }
+            int group = idx >> HIST_SUB_BITS;
+            uint64_t sub = idx & ((1 << HIST_SUB_BITS) - 1);
+            return ((1ull << HIST_SUB_BITS) + sub) << (group - 1);
+        }
+
+        void record(uint64_t ns)
+        {
+            auto &b = buckets[index(ns)];
+            b.store(b.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            total.add();
+            sum.add(ns);
+            if (ns > top.load(memory_order_relaxed)) {
+                top.store(ns, memory_order_relaxed);
+            }
+        }
+
+        // add this histogram's buckets to a snapshot
+        void collect(vector<uint64_t> &into, uint64_t &count, uint64_t &total_ns, uint64_t &max_ns) const
+        {
+            into.resize(HIST_BUCKETS);
+            for (int k = 0; k < HIST_BUCKETS; k++) {
+                into[k] += buckets[k].load(memory_order_relaxed);
+            }
+            count += total.get();
+            total_ns += sum.get();
+            max_ns = max(max_ns, top.load(memory_order_relaxed));
+        }
+};
+
+// the metrics of one thread, every event loop thread (server, shard) writes only its own
+//
+// Metrics::local() is the calling thread's instance, snapshot() and prometheus() add up
+// all instances and can be called from any thread
+class Metrics
+{
+    static inline mutex registryLock;
+    static inline vector<shared_ptr<Metrics>> registry;    // threads that have exited keep their totals
+    static inline vector<string> topicNames;                // "method topic" of each topic id
+    static inline atomic<bool> on{true};
+
+    struct Summary
+    {
+        vector<uint64_t> buckets;
+        uint64_t count = 0, sum = 0, max = 0;
+
+        double percentile(double p) const
+        {
+            if (count == 0) {
+                return 0;
+            }
+            uint64_t rank = uint64_t(p / 100 * count), seen = 0;
+            for (size_t k = 0; k < buckets.size(); k++) {
+                seen += buckets[k];
+                if (seen > rank) {
+                    return double(Histogram::lower(k));
+                }
+            }
+            return double(max);
+        }
+    };
+
+    static Summary summarize(Histogram Metrics::*h)
+    {
+        Summary s;
+        lock_guard<mutex> g(registryLock);
+        for (auto &m : registry) {
+            (m.get()->*h).collect(s.buckets, s.count, s.sum, s.max);
+        }
+        return s;
+    }
+
+    static uint64_t sum(Counter Metrics::*c)
+    {
+        uint64_t n = 0;
+        lock_guard<mutex> g(registryLock);
+        for (auto &m : registry) {
+            n += (m.get()->*c).get();
+        }
+        return n;
+    }
+
+    public:
+        Counter accepted;       // connections
+        Counter closed;
+        Counter bytesIn;
+        Counter bytesOut;       // queued for sending
+        Counter requests;
+        Counter unknown;        // no route for the topic
+        Counter errors;         // invalid messages, handler and socket errors
+        Counter timeouts;
+        Counter rejected;       // connections over the server's limit
+        Counter shed;           // requests answered busy under load
+        Counter cached;         // requests answered from the reply cache
+        Counter coalesced;      // offloaded reads that waited for an identical one
+        Counter topics[MAX_TOPICS];
+        Histogram parse, handler, write;    // ns
+
+        static Metrics &local()
+        {
+            thread_local Metrics *m = [] {
+                auto p = make_shared<Metrics>();
+                lock_guard<mutex> g(registryLock);
+                registry.push_back(p);
+                return p.get();
+            }();
+            return *m;
+        }
+
+        // histograms cost two clock reads per stage, off skips them, counters always count
+        static void enable(bool yes)
+        {
+            on.store(yes, memory_order_relaxed);
+        }
+
+        static bool enabled()
+        {
+            return on.load(memory_order_relaxed);
+        }
+
+        // monotonic ns for the histograms, 0 when they are off
+        static uint64_t clock()
+        {
+            if (!enabled()) {
+                return 0;
+            }
+            return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // record the time since start (from clock()) in h, returns the current clock()
+        static uint64_t lap(Histogram &h, uint64_t start)
+        {
+            if (start == 0) {
+                return 0;
+            }
+            uint64_t now = clock();
+            h.record(now - start);
+            return now;
+        }
+
+        // id of a (method, topic) pair for the topics[] counters, same pair same id in every thread
+        static int topicId(string_view method, string_view topic)
+        {
+            string key = string(method) + " " + string(topic);
+            lock_guard<mutex> g(registryLock);
+            for (size_t k = 0; k < topicNames.size(); k++) {
+                if (topicNames[k] == key) {
+                    return int(k);
+                }
+            }
+            if (topicNames.size() + 1 >= MAX_TOPICS) {
+                return MAX_TOPICS - 1;
+            }
+            topicNames.push_back(key);
+            return int(topicNames.size() - 1);
+        }
+
+        // totals of all threads
+        // {"connections":{...}, "bytes":{...}, "requests":{...}, "topics":{...}, "latency_us":{"parse":{...}, ...}}
+        static json snapshot()
+        {
+            json j;
+            j["connections"] = {{"accepted", sum(&Metrics::accepted)}, {"closed", sum(&Metrics::closed)},
+                                {"rejected", sum(&Metrics::rejected)}};
+            j["bytes"] = {{"in", sum(&Metrics::bytesIn)}, {"out", sum(&Metrics::bytesOut)}};
+            j["requests"] = {{"total", sum(&Metrics::requests)}, {"unknown", sum(&Metrics::unknown)},
+                             {"errors", sum(&Metrics::errors)}, {"timeouts", sum(&Metrics::timeouts)},
+                             {"shed", sum(&Metrics::shed)}, {"cached", sum(&Metrics::cached)},
+                             {"coalesced", sum(&Metrics::coalesced)}};
+
+            json topics = json::object();
+            vector<string> names;
+            {
+                lock_guard<mutex> g(registryLock);
+                names = topicNames;
+            }
+            for (size_t k = 0; k < names.size(); k++) {
+                uint64_t n = 0;
+                lock_guard<mutex> g(registryLock);
+                for (auto &m : registry) {
+                    n += m->topics[k].get();
+                }
+                topics[names[k]] = n;
+            }
+            j["topics"] = topics;
+
+            if (enabled()) {
+                json lat;
+                for (auto [name, h] : {pair{"parse", &Metrics::parse}, pair{"handler", &Metrics::handler}, pair{"write", &Metrics::write}}) {
+                    Summary s = summarize(h);
+                    lat[name] = {{"count", s.count}, {"mean", s.count ? s.sum / 1000.0 / s.count : 0},
+                                 {"p50", s.percentile(50) / 1000}, {"p99", s.percentile(99) / 1000},
+                                 {"p99.9", s.percentile(99.9) / 1000}, {"max", s.max / 1000.0}};
+                }
+                j["latency_us"] = lat;
+            }
+            return j;
+        }
+
+        // the same totals in the Prometheus text exposition format
+        static string prometheus()
+        {
+            string out;
+            auto metric = [&out](const char *name, const char *type, const char *help) {
+                out += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+            };
+            auto line = [&out](const string &name, double v) {
+                char num[32];
+                snprintf(num, sizeof(num), "%.17g", v);
+                out += name + " " + num + "\n";
+            };
+
+            metric("edge_connections_total", "counter", "Client connections accepted, closed and rejected over the limit.");
+            line("edge_connections_total{event=\"accepted\"}", sum(&Metrics::accepted));
+            line("edge_connections_total{event=\"closed\"}", sum(&Metrics::closed));
+            line("edge_connections_total{event=\"rejected\"}", sum(&Metrics::rejected));
+            metric("edge_bytes_total", "counter", "Bytes received and queued for sending.");
+            line("edge_bytes_total{direction=\"in\"}", sum(&Metrics::bytesIn));
+            line("edge_bytes_total{direction=\"out\"}", sum(&Metrics::bytesOut));
+            metric("edge_requests_total", "counter", "Requests by (method, topic).");
+            vector<string> names;
+            {
+                lock_guard<mutex> g(registryLock);
+                names = topicNames;
+            }
+            for (size_t k = 0; k < names.size(); k++) {
+                uint64_t n = 0;
+                {
+                    lock_guard<mutex> g(registryLock);
+                    for (auto &m : registry) {
+                        n += m->topics[k].get();
+                    }
+                }
+                size_t sp = names[k].find(' ');
+                line("edge_requests_total{method=\"" + names[k].substr(0, sp) + "\",topic=\"" + names[k].substr(sp + 1) + "\"}", n);
+            }
+            line("edge_requests_total{method=\"\",topic=\"unknown\"}", sum(&Metrics::unknown));
+            metric("edge_errors_total", "counter", "Invalid messages, handler and socket errors.");
+            line("edge_errors_total", sum(&Metrics::errors));
+            metric("edge_timeouts_total", "counter", "Read and request timeouts.");
+            line("edge_timeouts_total", sum(&Metrics::timeouts));
+            metric("edge_shed_requests_total", "counter", "Requests answered busy under load.");
+            line("edge_shed_requests_total", sum(&Metrics::shed));
+            metric("edge_shared_replies_total", "counter", "Requests answered with a reply made for an identical request.");
+            line("edge_shared_replies_total{source=\"cache\"}", sum(&Metrics::cached));
+            line("edge_shared_replies_total{source=\"coalesced\"}", sum(&Metrics::coalesced));
+
+            if (enabled()) {
+                for (auto [name, h] : {pair{"parse", &Metrics::parse}, pair{"handler", &Metrics::handler}, pair{"write", &Metrics::write}}) {
+                    string m = string("edge_") + name + "_seconds";
+                    metric(m.c_str(), "histogram", "Request path latency.");
+                    Summary s = summarize(h);
+                    // cumulative buckets at powers of two, enough for alerting on the tail
+                    uint64_t seen = 0;
+                    size_t k = 0;
+                    for (int e = 10; e <= 36; e += 2) {
+                        uint64_t le = 1ull << e;
+                        for (; k < s.buckets.size() && Histogram::lower(k) < le; k++) {
+                            seen += s.buckets[k];
+                        }
+                        char bound[32];
+                        snprintf(bound, sizeof(bound), "%g", le / 1e9);
+                        line(m + "_bucket{le=\"" + bound + "\"}", seen);
+                    }
+                    line(m + "_bucket{le=\"+Inf\"}", s.count);
+                    line(m + "_sum", s.sum / 1e9);
+                    line(m + "_count", s.count);
+                }
+            }
+            return out;
+        }
+};
+
+}
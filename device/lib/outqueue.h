@@ -0,0 +1,203 @@
+/*
+ * Source File: outqueue.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include "pool.h"
+
+#define MAX_IOV         64
+
+namespace Tcp {
+
+using namespace std;
+
+// send all of data on a blocking or non-blocking socket, waiting up to timeout ms
+// for the socket to become writable again after a short write
+// returns the number of bytes sent, less than data.size() on timeout or error
+inline size_t sendAll(int fd, string_view data, int timeout = 1000)
+{
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n{send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL | MSG_DONTWAIT)};
+        if (n > 0) {
+            off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd p{fd, POLLOUT, 0};
+            if (poll(&p, 1, timeout) > 0) {
+                continue;
+            }
+            errno = ETIMEDOUT;
+        }
+        break;
+    }
+    return off;
+}
+
+// per-connection output queue, keeps what the socket did not take and sends
+// several queued messages with one writev() when the socket is writable again
+// the bytes are copied into a chain of pooled blocks, queueing a reply does not allocate
+class OutQueue
+{
+    IoBlock *head = nullptr, *tail = nullptr;
+    size_t offset = 0;  // bytes of head already sent
+    size_t queued = 0;  // bytes not yet sent
+    uint64_t total = 0; // bytes sent since the queue was created
+
+    void clear()
+    {
+        while (head) {
+            IoBlock *b = head;
+            head = b->next;
+            BufferPool::put(b);
+        }
+        tail = nullptr;
+        offset = queued = 0;
+    }
+
+    public:
+        OutQueue() {}
+        OutQueue(const OutQueue&) = delete;
+        OutQueue& operator=(const OutQueue&) = delete;
+        OutQueue(OutQueue &&o) noexcept : head{o.head}, tail{o.tail}, offset{o.offset}, queued{o.queued}, total{o.total}
+        {
+            o.head = o.tail = nullptr;
+            o.offset = o.queued = 0;
+            o.total = 0;
+        }
+        OutQueue& operator=(OutQueue &&o) noexcept
+        {
+            if (this != &o) {
+                clear();
+                swap(head, o.head);
+                swap(tail, o.tail);
+                swap(offset, o.offset);
+                swap(queued, o.queued);
+                swap(total, o.total);
+            }
+            return *this;
+        }
+        ~OutQueue()
+        {
+            clear();
+        }
+
+        bool empty() const
+        {
+            return queued == 0;
+        }
+
+        // bytes waiting to be sent
+        size_t size() const
+        {
+            return queued;
+        }
+
+        // bytes sent so far, tells a slow reader from one that takes nothing
+        uint64_t sent() const
+        {
+            return total;
+        }
+
+        void push(string_view msg)
+        {
+            queued += msg.size();
+            while (!msg.empty()) {
+                if (!tail || tail->len == IoBlock::capacity) {
+                    IoBlock *b = BufferPool::get();
+                    if (tail) {
+                        tail->next = b;
+                    }
+                    else {
+                        head = b;
+                    }
+                    tail = b;
+                }
+                size_t n = min(msg.size(), IoBlock::capacity - tail->len);
+                memcpy(tail->data + tail->len, msg.data(), n);
+                tail->len += n;
+                msg.remove_prefix(n);
+            }
+        }
+
+        // point iov at up to max queued blocks, returns the number of entries filled
+        // the blocks stay in place until consume() drops them, more can be pushed meanwhile
+        int gather(iovec *iov, int max) const
+        {
+            int cnt = 0;
+            for (IoBlock *b = head; b && cnt < max; b = b->next) {
+                size_t skip = b == head ? offset : 0;
+                if (b->len == skip) {
+                    break;
+                }
+                iov[cnt].iov_base = b->data + skip;
+                iov[cnt].iov_len = b->len - skip;
+                cnt++;
+            }
+            return cnt;
+        }
+
+        // drop n sent bytes, fully sent blocks go back to the pool
+        void consume(size_t n)
+        {
+            queued -= n;
+            total += n;
+            while (n > 0) {
+                size_t rest = head->len - offset;
+                if (n < rest) {
+                    offset += n;
+                    break;
+                }
+                n -= rest;
+                offset = 0;
+                IoBlock *b = head;
+                head = b->next;
+                if (!head) {
+                    tail = nullptr;
+                }
+                BufferPool::put(b);
+            }
+            if (queued == 0 && head) {
+                // everything went out but the last block, keep it for the next replies
+                offset = head->len = 0;
+            }
+        }
+
+        // write as much as the socket takes without blocking
+        // returns 1 when the queue is empty, 0 when the socket is full and -1 on a socket error
+        int flush(int fd)
+        {
+            while (queued > 0) {
+                iovec iov[MAX_IOV];
+                msghdr mh{};
+                mh.msg_iov = iov;
+                mh.msg_iovlen = gather(iov, MAX_IOV);
+                ssize_t n{sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT)};
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+                }
+                consume(n);
+            }
+            return 1;
+        }
+};
+
+}
+
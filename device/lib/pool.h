@@ -0,0 +1,303 @@
+/*
+ * Source File: pool.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <new>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define POOL_BLOCK      16384   // bytes of one pooled i/o block, header included
+#define POOL_KEEP       256     // free blocks a thread keeps, the rest go back to the heap
+#define SLAB_CHUNK      64      // objects allocated at once by a Slab
+
+namespace Tcp {
+
+using namespace std;
+
+// fixed-size i/o buffer, output queues chain them and the request arena carves them up
+struct IoBlock
+{
+    static constexpr size_t capacity = POOL_BLOCK - 2 * sizeof(void *);
+
+    IoBlock *next = nullptr;
+    size_t len = 0;     // bytes used
+    char data[capacity];
+};
+
+// per-thread free list of IoBlocks, every event loop thread recycles the blocks it uses so
+// the request path does not go to the heap once the loop has warmed up
+class BufferPool
+{
+    IoBlock *free = nullptr;
+    size_t count = 0;
+
+    static BufferPool &local()
+    {
+        thread_local BufferPool p;
+        return p;
+    }
+
+    public:
+        BufferPool() {}
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+        ~BufferPool()
+        {
+            while (free) {
+                IoBlock *b = free;
+                free = b->next;
+                delete b;
+            }
+        }
+
+        static IoBlock *get()
+        {
+            BufferPool &p = local();
+            IoBlock *b = p.free;
+            if (!b) {
+                return new IoBlock;
+            }
+            p.free = b->next;
+            p.count--;
+            b->next = nullptr;
+            b->len = 0;
+            return b;
+        }
+
+        // a block may be returned on any thread, it joins that thread's free list
+        static void put(IoBlock *b)
+        {
+            BufferPool &p = local();
+            if (p.count >= POOL_KEEP) {
+                delete b;
+                return;
+            }
+            b->next = p.free;
+            p.free = b;
+            p.count++;
+        }
+};
+
+// free list allocator for objects of one size, each thread allocates from its own list
+// the chunks are never given back, a thread that exits hands its free slots to the next one
+template<size_t Size>
+class Slab
+{
+    struct Slot
+    {
+        Slot *next;
+    };
+    static constexpr size_t slotSize = (max(Size, sizeof(Slot)) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+    Slot *free = nullptr;
+
+    static inline mutex spareLock;
+    static inline Slot *spare = nullptr;    // free slots of threads that have exited
+
+    static Slab &local()
+    {
+        thread_local Slab s;
+        return s;
+    }
+
+    void grow()
+    {
+        {
+            lock_guard<mutex> g(spareLock);
+            if (spare) {
+                free = spare;
+                spare = nullptr;
+                return;
+            }
+        }
+        char *chunk = static_cast<char *>(::operator new(slotSize * SLAB_CHUNK));
+        for (size_t k = 0; k < SLAB_CHUNK; k++) {
+            Slot *s = reinterpret_cast<Slot *>(chunk + k * slotSize);
+            s->next = free;
+            free = s;
+        }
+    }
+
+    public:
+        Slab() {}
+        Slab(const Slab&) = delete;
+        Slab& operator=(const Slab&) = delete;
+        ~Slab()
+        {
+            if (!free) {
+                return;
+            }
+            Slot *last = free;
+            while (last->next) {
+                last = last->next;
+            }
+            lock_guard<mutex> g(spareLock);
+            last->next = spare;
+            spare = free;
+        }
+
+        static void *alloc()
+        {
+            Slab &s = local();
+            if (!s.free) {
+                s.grow();
+            }
+            Slot *p = s.free;
+            s.free = p->next;
+            return p;
+        }
+
+        static void release(void *p)
+        {
+            Slab &s = local();
+            Slot *slot = static_cast<Slot *>(p);
+            slot->next = s.free;
+            s.free = slot;
+        }
+};
+
+// give a class slab allocated instances, make_unique<T>() and delete stay as they are
+// class Connection : public Pooled<Connection>
+template<class T>
+struct Pooled
+{
+    static void *operator new(size_t n)
+    {
+        // a derived class of another size goes to the heap
+        return n == sizeof(T) ? Slab<sizeof(T)>::alloc() : ::operator new(n);
+    }
+
+    static void operator delete(void *p, size_t n)
+    {
+        if (n == sizeof(T)) {
+            Slab<sizeof(T)>::release(p);
+        }
+        else {
+            ::operator delete(p);
+        }
+    }
+};
+
+// per-thread bump allocator for memory that lives as long as one request, e.g. its reply,
+// reset() drops everything at once and keeps the first block for the next request
+class Arena
+{
+    IoBlock *first = nullptr, *current = nullptr;
+    vector<void *> large;   // allocations that do not fit a block
+
+    public:
+        Arena() {}
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        ~Arena()
+        {
+            // at thread exit the thread's BufferPool may be gone already
+            for (void *p : large) {
+                ::operator delete(p);
+            }
+            while (first) {
+                IoBlock *b = first;
+                first = b->next;
+                delete b;
+            }
+        }
+
+        static Arena &local()
+        {
+            thread_local Arena a;
+            return a;
+        }
+
+        void *alloc(size_t n, size_t align = alignof(max_align_t))
+        {
+            if (n > IoBlock::capacity / 2) {
+                large.push_back(::operator new(n));
+                return large.back();
+            }
+            if (!current) {
+                first = current = BufferPool::get();
+            }
+            size_t at = (current->len + align - 1) & ~(align - 1);
+            if (at + n > IoBlock::capacity) {
+                IoBlock *b = BufferPool::get();
+                current->next = b;
+                current = b;
+                at = 0;
+            }
+            current->len = at + n;
+            return current->data + at;
+        }
+
+        // give back the most recent allocation, e.g. a string that grows, older ones wait for reset()
+        void release(void *p, size_t n)
+        {
+            if (n > IoBlock::capacity / 2) {
+                for (size_t k = large.size(); k-- > 0;) {
+                    if (large[k] == p) {
+                        ::operator delete(p);
+                        large.erase(large.begin() + k);
+                        return;
+                    }
+                }
+                return;
+            }
+            if (current && static_cast<char *>(p) + n == current->data + current->len) {
+                current->len -= n;
+            }
+        }
+
+        // drop everything allocated since the last reset, nothing allocated from it may be used after
+        void reset()
+        {
+            for (void *p : large) {
+                ::operator delete(p);
+            }
+            large.clear();
+            if (!first) {
+                return;
+            }
+            for (IoBlock *b = first->next; b;) {
+                IoBlock *n = b->next;
+                BufferPool::put(b);
+                b = n;
+            }
+            first->next = nullptr;
+            first->len = 0;
+            current = first;
+        }
+};
+
+// std allocator on the calling thread's Arena
+template<class T>
+struct ArenaAllocator
+{
+    using value_type = T;
+
+    ArenaAllocator() = default;
+    template<class U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(Arena::local().alloc(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        Arena::local().release(p, n * sizeof(T));
+    }
+
+    template<class U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template<class U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+// a string in the request arena, valid until the request is done
+using ArenaString = basic_string<char, char_traits<char>, ArenaAllocator<char>>;
+
+}
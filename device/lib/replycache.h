@@ -0,0 +1,205 @@
+/*
+ * Source File: replycache.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "executor.h"
+
+#define REPLY_CACHE_STRIPES     16      // topics are spread over this many locks
+#define REPLY_CACHE_ENTRIES     4096    // cached replies per stripe, more are not kept
+
+namespace Tcp {
+
+using namespace std;
+
+// serialized replies of idempotent reads, shared by all event loops of a Router, each stripe
+// behind its own mutex
+// a request is identified by its bytes, json text, cbor and msgpack messages never look alike,
+// identical requests reuse a reply until its ttl runs out or a write to the topic drops it,
+// and identical offloaded reads that come in while one runs wait for its reply
+// requests tagged with an id (AsyncClient) get it echoed in their reply, no two are alike,
+// the Router does not cache them
+class ReplyCache
+{
+    public:
+        // a connection waiting for the reply of an offloaded read
+        struct Waiter
+        {
+            CompletionQueue *queue;
+            int fd;
+            uint64_t conn;
+        };
+
+        // an offloaded read in progress and the identical requests waiting for it
+        struct Flight
+        {
+            vector<Waiter> waiters;
+        };
+
+    private:
+        struct Hash
+        {
+            using is_transparent = void;
+            size_t operator()(string_view s) const { return hash<string_view>{}(s); }
+        };
+
+        template<class T>
+        using Map = unordered_map<string, T, Hash, equal_to<>>;
+
+        struct Entry
+        {
+            shared_ptr<const string> reply;     // null while in flight
+            int64_t expires = 0;
+            shared_ptr<Flight> flight;
+        };
+
+        struct Stripe
+        {
+            mutex lock;
+            Map<Map<Entry>> topics;     // topic -> request -> entry
+            size_t entries = 0;
+        };
+
+        Stripe stripes[REPLY_CACHE_STRIPES];
+
+        static int64_t now()
+        {
+            return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        Stripe &stripe(string_view topic)
+        {
+            return stripes[hash<string_view>{}(topic) % REPLY_CACHE_STRIPES];
+        }
+
+        static Map<Entry> &topicEntries(Stripe &s, string_view topic)
+        {
+            auto t = s.topics.find(topic);
+            return t != s.topics.end() ? t->second : s.topics[string(topic)];
+        }
+
+        // drop the expired replies of s, its lock is held
+        static void sweep(Stripe &s, int64_t t)
+        {
+            for (auto it = s.topics.begin(); it != s.topics.end();) {
+                s.entries -= erase_if(it->second, [t](auto &p) { return !p.second.flight && p.second.expires <= t; });
+                it = it->second.empty() ? s.topics.erase(it) : next(it);
+            }
+        }
+
+    public:
+        ReplyCache() {}
+        ReplyCache(const ReplyCache&) = delete;
+        ReplyCache& operator=(const ReplyCache&) = delete;
+
+        // the cached reply to msg, null if there is none or it expired
+        shared_ptr<const string> get(string_view topic, string_view msg)
+        {
+            Stripe &s = stripe(topic);
+            lock_guard<mutex> g(s.lock);
+            auto t = s.topics.find(topic);
+            if (t == s.topics.end()) {
+                return nullptr;
+            }
+            auto e = t->second.find(msg);
+            if (e == t->second.end() || !e->second.reply || e->second.expires <= now()) {
+                return nullptr;
+            }
+            return e->second.reply;
+        }
+
+        // keep reply to msg for ttl ms
+        void put(string_view topic, string_view msg, shared_ptr<const string> reply, int ttl)
+        {
+            if (ttl <= 0) {
+                return;
+            }
+            Stripe &s = stripe(topic);
+            lock_guard<mutex> g(s.lock);
+            int64_t t = now();
+            if (s.entries >= REPLY_CACHE_ENTRIES) {
+                sweep(s, t);
+            }
+            auto &m = topicEntries(s, topic);
+            auto e = m.find(msg);
+            if (e == m.end()) {
+                if (s.entries >= REPLY_CACHE_ENTRIES) {
+                    return;
+                }
+                e = m.emplace(string(msg), Entry{}).first;
+                s.entries++;
+            }
+            e->second.reply = move(reply);
+            e->second.expires = t + ttl;
+        }
+
+        // w waits for the reply to msg, returns a new flight when no identical read is running,
+        // the caller runs the handler then and hands the reply to land(), else nullptr
+        shared_ptr<Flight> join(string_view topic, string_view msg, const Waiter &w)
+        {
+            Stripe &s = stripe(topic);
+            lock_guard<mutex> g(s.lock);
+            auto &m = topicEntries(s, topic);
+            auto e = m.find(msg);
+            if (e == m.end()) {
+                e = m.emplace(string(msg), Entry{}).first;
+                s.entries++;
+            }
+            else if (e->second.flight) {
+                e->second.flight->waiters.push_back(w);
+                return nullptr;
+            }
+            e->second.flight = make_shared<Flight>();
+            e->second.flight->waiters.push_back(w);
+            return e->second.flight;
+        }
+
+        // f is done, its reply is kept for ttl ms unless a write dropped the flight meanwhile
+        // returns the connections waiting for it
+        vector<Waiter> land(string_view topic, string_view msg, const shared_ptr<Flight> &f, shared_ptr<const string> reply, int ttl)
+        {
+            Stripe &s = stripe(topic);
+            lock_guard<mutex> g(s.lock);
+            auto t = s.topics.find(topic);
+            if (t != s.topics.end()) {
+                auto e = t->second.find(msg);
+                if (e != t->second.end() && e->second.flight == f) {
+                    e->second.flight = nullptr;
+                    if (ttl > 0) {
+                        e->second.reply = move(reply);
+                        e->second.expires = now() + ttl;
+                    }
+                    else if (!e->second.reply) {
+                        t->second.erase(e);
+                        s.entries--;
+                    }
+                }
+            }
+            return move(f->waiters);
+        }
+
+        // a write changed topic, its cached replies are dropped and reads in flight are not kept
+        void invalidate(string_view topic)
+        {
+            Stripe &s = stripe(topic);
+            lock_guard<mutex> g(s.lock);
+            auto t = s.topics.find(topic);
+            if (t != s.topics.end()) {
+                s.entries -= t->second.size();
+                s.topics.erase(t);
+            }
+        }
+};
+
+}
@@ -0,0 +1,455 @@
+/*
+ * Source File: request.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <nlohmann/json.hpp>
+#include "framing.h"
+#include "pool.h"
+
+namespace Tcp {
+
+using namespace std;
+using json = nlohmann::json;
+
+// append v to out as a quoted json string
+template<class String>
+inline void appendQuoted(String &out, string_view v)
+{
+    out.push_back('"');
+    for (char c : v) {
+        switch (c) {
+            case '"':  out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out.append(esc);
+                }
+                else {
+                    out.push_back(c);
+                }
+        }
+    }
+    out.push_back('"');
+}
+
+// one client request as seen by the router handlers
+// {topic:"random-data", method:"node-edge-read", payload:"", value:""}
+//
+// the topic, method and payload fields are read straight from the received bytes,
+// the json document is only built when a handler asks for doc()
+class Request
+{
+    string_view raw;
+    Encoding enc;
+    json doc_;
+    bool parsed = false;
+    size_t valueBegin = 0, valueEnd = 0;    // span of the "value" member's value in raw, empty if none
+    size_t closeBrace = 0;                  // position of the object's closing brace in raw
+
+    static size_t skipSpace(string_view s, size_t i)
+    {
+        while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) {
+            i++;
+        }
+        return i;
+    }
+
+    // i is on the opening quote, returns the position after the closing quote or npos if the
+    // string is not valid json
+    static size_t skipString(string_view s, size_t i, bool &escaped)
+    {
+        for (i++; i < s.size(); i++) {
+            unsigned char c = s[i];
+            if (c == '\\') {
+                escaped = true;
+                if (++i >= s.size()) {
+                    break;
+                }
+                if (s[i] == 'u') {
+                    for (int k = 0; k < 4; k++) {
+                        if (++i >= s.size() || !isxdigit(static_cast<unsigned char>(s[i]))) {
+                            return string_view::npos;
+                        }
+                    }
+                }
+                else if (s[i] == 0 || !strchr("\"\\/bfnrt", s[i])) {
+                    return string_view::npos;
+                }
+            }
+            else if (c == '"') {
+                return i + 1;
+            }
+            else if (c < 0x20) {
+                return string_view::npos;
+            }
+        }
+        return string_view::npos;
+    }
+
+    static size_t skipDigits(string_view s, size_t i)
+    {
+        while (i < s.size() && isdigit(static_cast<unsigned char>(s[i]))) {
+            i++;
+        }
+        return i;
+    }
+
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?, returns the position after it or npos
+    static size_t skipNumber(string_view s, size_t i)
+    {
+        if (i < s.size() && s[i] == '-') {
+            i++;
+        }
+        size_t b = i;
+        if (i < s.size() && s[i] == '0') {
+            i++;
+        }
+        else if ((i = skipDigits(s, i)) == b) {
+            return string_view::npos;
+        }
+        if (i < s.size() && s[i] == '.') {
+            b = ++i;
+            if ((i = skipDigits(s, i)) == b) {
+                return string_view::npos;
+            }
+        }
+        if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+            i++;
+            if (i < s.size() && (s[i] == '+' || s[i] == '-')) {
+                i++;
+            }
+            b = i;
+            if ((i = skipDigits(s, i)) == b) {
+                return string_view::npos;
+            }
+        }
+        return i;
+    }
+
+    // i is on the first character of a value, returns the position after it or npos if it is
+    // not valid json, values nested deeper than depth are left to the json parser too
+    static size_t skipValue(string_view s, size_t i, int depth = 32)
+    {
+        bool escaped = false;
+        char c = s[i];
+        if (c == '"') {
+            return skipString(s, i, escaped);
+        }
+        if (c == '{' || c == '[') {
+            char close = c == '{' ? '}' : ']';
+            if (depth == 0) {
+                return string_view::npos;
+            }
+            i = skipSpace(s, i + 1);
+            if (i < s.size() && s[i] == close) {
+                return i + 1;
+            }
+            for (;;) {
+                if (i >= s.size()) {
+                    return string_view::npos;
+                }
+                if (c == '{') {
+                    if (s[i] != '"' || (i = skipString(s, i, escaped)) == string_view::npos) {
+                        return string_view::npos;
+                    }
+                    i = skipSpace(s, i);
+                    if (i >= s.size() || s[i] != ':') {
+                        return string_view::npos;
+                    }
+                    i = skipSpace(s, i + 1);
+                    if (i >= s.size()) {
+                        return string_view::npos;
+                    }
+                }
+                if ((i = skipValue(s, i, depth - 1)) == string_view::npos) {
+                    return i;
+                }
+                i = skipSpace(s, i);
+                if (i < s.size() && s[i] == ',') {
+                    i = skipSpace(s, i + 1);
+                }
+                else if (i < s.size() && s[i] == close) {
+                    return i + 1;
+                }
+                else {
+                    return string_view::npos;
+                }
+            }
+        }
+        for (string_view lit : {"true", "false", "null"}) {
+            if (s.substr(i, lit.size()) == lit) {
+                return i + lit.size();
+            }
+        }
+        return skipNumber(s, i);
+    }
+
+    // walk the top level members once, false if the message needs the full json parser
+    bool scan()
+    {
+        string_view s = raw;
+        size_t i = skipSpace(s, 0);
+        if (i >= s.size() || s[i] != '{') {
+            return false;
+        }
+        i = skipSpace(s, i + 1);
+        if (i < s.size() && s[i] == '}') {
+            closeBrace = i;
+            return skipSpace(s, i + 1) == s.size();
+        }
+        for (;;) {
+            if (i >= s.size() || s[i] != '"') {
+                return false;
+            }
+            bool escaped = false;
+            size_t k = skipString(s, i, escaped);
+            if (k == string_view::npos || escaped) {
+                return false;
+            }
+            string_view key = s.substr(i + 1, k - i - 2);
+            i = skipSpace(s, k);
+            if (i >= s.size() || s[i] != ':') {
+                return false;
+            }
+            i = skipSpace(s, i + 1);
+            if (i >= s.size()) {
+                return false;
+            }
+            size_t v = i;
+            i = skipValue(s, v);
+            if (i == string_view::npos) {
+                return false;
+            }
+
+            bool str = s[v] == '"';
+            string_view val = str ? s.substr(v + 1, i - v - 2) : s.substr(v, i - v);
+            if (str && val.find('\\') != string_view::npos && (key == "method" || key == "topic" || key == "payload")) {
+                return false;
+            }
+            if (key == "method" && str) {
+                method = val;
+            }
+            else if (key == "topic" && str) {
+                topic = val;
+            }
+            else if (key == "payload" && str) {
+                payload = val;
+                hasPayload = true;
+            }
+            else if (key == "value") {
+                valueBegin = v;
+                valueEnd = i;
+            }
+            else if (key == "id" && !str) {
+                from_chars(val.data(), val.data() + val.size(), id);
+            }
+            else if (key == "maxAge" && !str) {
+                from_chars(val.data(), val.data() + val.size(), maxAge);
+            }
+            else if (key == "deadband" && !str) {
+                from_chars(val.data(), val.data() + val.size(), deadband);
+            }
+            else if (key == "interval" && !str) {
+                from_chars(val.data(), val.data() + val.size(), interval);
+            }
+
+            i = skipSpace(s, i);
+            if (i < s.size() && s[i] == ',') {
+                i = skipSpace(s, i + 1);
+                continue;
+            }
+            if (i < s.size() && s[i] == '}') {
+                closeBrace = i;
+                return skipSpace(s, i + 1) == s.size();
+            }
+            return false;
+        }
+    }
+
+    static string_view field(const json &j, const char *key)
+    {
+        auto it = j.find(key);
+        if (it == j.end() || !it->is_string()) {
+            return {};
+        }
+        return it->get_ref<const string&>();
+    }
+
+    static json decode(string_view msg, Encoding e)
+    {
+        auto b = reinterpret_cast<const uint8_t *>(msg.data());
+        switch (e) {
+            case Encoding::Cbor:
+                return json::from_cbor(b, b + msg.size());
+            case Encoding::MsgPack:
+                return json::from_msgpack(b, b + msg.size());
+            default:
+                return json::parse(msg);
+        }
+    }
+
+    public:
+        // throws json::parse_error if msg is not a json string, or not valid cbor/msgpack
+        // for a connection that negotiated a binary encoding
+        explicit Request(string_view msg, Encoding e = Encoding::Json) : raw{msg}, enc{e}
+        {
+            // binary messages always go through the decoder, the handlers see the same fields
+            if (enc != Encoding::Json || !scan()) {
+                // escaped header fields or an unusual message, let the json parser decide
+                method = topic = payload = {};
+                hasPayload = false;
+                id = 0;
+                maxAge = -1;
+                deadband = 0;
+                interval = 0;
+                doc();
+                if (doc_.is_object()) {
+                    method = field(doc_, "method");
+                    topic = field(doc_, "topic");
+                    payload = field(doc_, "payload");
+                    auto it = doc_.find("payload");
+                    hasPayload = it != doc_.end() && it->is_string();
+                    it = doc_.find("id");
+                    if (it != doc_.end() && it->is_number_unsigned()) {
+                        id = it->get<uint64_t>();
+                    }
+                    it = doc_.find("maxAge");
+                    if (it != doc_.end() && it->is_number_integer()) {
+                        maxAge = it->get<int64_t>();
+                    }
+                    it = doc_.find("deadband");
+                    if (it != doc_.end() && it->is_number()) {
+                        deadband = it->get<double>();
+                    }
+                    it = doc_.find("interval");
+                    if (it != doc_.end() && it->is_number_integer()) {
+                        interval = it->get<int64_t>();
+                    }
+                }
+            }
+        }
+        Request(const Request&) = delete;
+        Request& operator=(const Request&) = delete;
+
+        // views into the request, do not outlive it or a change to the same doc() fields
+        string_view method, topic;
+        string_view payload;        // only set when the payload is a json string
+        bool hasPayload = false;
+        uint64_t id = 0;            // request id of a pipelining client (AsyncClient), 0 if none
+        int64_t maxAge = -1;        // oldest cached value in ms the client accepts, -1 if it did not say
+        double deadband = 0;        // node-edge-subscribe: smallest change of a number that is sent
+        int64_t interval = 0;       // node-edge-subscribe: ms between updates at least
+
+        // the message as received, only valid during the handler call
+        string_view message() const
+        {
+            return raw;
+        }
+
+        Encoding encoding() const
+        {
+            return enc;
+        }
+
+        // the parsed json document, built on first use
+        json &doc()
+        {
+            if (!parsed) {
+                doc_ = decode(raw, enc);
+                parsed = true;
+            }
+            return doc_;
+        }
+
+        // serialize j in the encoding the client uses, for handlers that build their own reply
+        string encode(const json &j) const
+        {
+            if (enc == Encoding::Json) {
+                return j.dump();
+            }
+            string out;
+            if (enc == Encoding::Cbor) {
+                json::to_cbor(j, out);
+            }
+            else {
+                json::to_msgpack(j, out);
+            }
+            return out;
+        }
+
+        // the request echoed back with its "value" member set to the string v
+        // spliced from the received bytes unless a handler already works on doc()
+        // the reply lives in the thread's request arena, write it or copy it before the handler returns
+        ArenaString reply(string_view v)
+        {
+            if (parsed) {
+                doc_["value"] = v;
+                string out = encode(doc_);
+                return ArenaString(out.data(), out.size());
+            }
+            return splice(v, true);
+        }
+
+        // same as reply() for a value that is already serialized json, e.g. from a TopicCache
+        ArenaString replyJson(string_view v)
+        {
+            if (parsed) {
+                doc_["value"] = json::parse(v);
+                string out = encode(doc_);
+                return ArenaString(out.data(), out.size());
+            }
+            return splice(v, false);
+        }
+
+    private:
+        static void appendValue(ArenaString &out, string_view v, bool quote)
+        {
+            if (quote) {
+                appendQuoted(out, v);
+            }
+            else {
+                out.append(v);
+            }
+        }
+
+        // v as the value member, quoted as a json string or as it is
+        ArenaString splice(string_view v, bool quote) const
+        {
+            ArenaString out;
+            out.reserve(raw.size() + v.size() + 12);
+            if (valueEnd > valueBegin) {
+                out.append(raw.substr(0, valueBegin));
+                appendValue(out, v, quote);
+                out.append(raw.substr(valueEnd));
+            }
+            else {
+                // no value member yet, add one before the closing brace
+                out.append(raw.substr(0, closeBrace));
+                if (raw.find_last_not_of(" \t\r\n", closeBrace - 1) != raw.find('{')) {
+                    out.push_back(',');
+                }
+                out.append("\"value\":");
+                appendValue(out, v, quote);
+                out.append(raw.substr(closeBrace));
+            }
+            return out;
+        }
+};
+
+}
+
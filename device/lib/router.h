@@ -0,0 +1,473 @@
+/*
+ * Source File: router.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "connection.h"
+#include "executor.h"
+#include "log.h"
+#include "metrics.h"
+#include "replycache.h"
+#include "request.h"
+#include "subscribe.h"
+#include "wal.h"
+
+namespace Tcp {
+
+using namespace std;
+
+using RouteHandler = function<void(Connection&, Request&)>;
+
+// handler that may block, it runs on an Executor thread and returns the reply instead of writing it
+// e.g. [](Request &req) { return req.replyJson(readSensor()); }
+using BlockingHandler = function<ArenaString(Request&)>;
+
+// 64 bit FNV-1a hash of a (method, topic) pair, usable at compile time e.g.
+// static constexpr auto READ_RANDOM = routeHash("node-edge-read", "random-data");
+constexpr uint64_t routeHash(string_view method, string_view topic)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (char c : method) {
+        h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    h = (h ^ 0xff) * 1099511628211ull; // separator, 0xff never appears in utf-8 text
+    for (char c : topic) {
+        h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return h;
+}
+
+// dispatches requests to the handler registered for their (method, topic) pair
+// use it as the server request handler, s->onRequest(router)
+class Router
+{
+    struct Route
+    {
+        uint64_t hash = 0;
+        string method, topic;
+        RouteHandler handler;
+        int stat = 0;   // Metrics topic id
+        RouteOptions opt;
+        bool offloaded = false;     // registered by offload(), it caches its replies itself
+        BlockingHandler apply;      // of a logged() route, replay() runs it again
+    };
+
+    vector<Route> table = vector<Route>(16);    // open addressing, size is a power of two
+    size_t used = 0;
+    string unknownReply[3] = {"invalid topic"};     // indexed by Encoding
+    string invalidReply[3] = {"invalid json data"};
+    string busyReply[3] = {"server busy"};
+    string failedReply[3] = {"write failed"};
+    shared_ptr<ReplyCache> cache = make_shared<ReplyCache>();  // shared by the copies of the Router
+    bool caching = false;   // some route shares its replies, writes drop them
+
+    // prebuild msg in every encoding, json clients get it as plain text like before
+    static void prebuild(string (&out)[3], string msg)
+    {
+        out[int(Encoding::Cbor)].clear();
+        out[int(Encoding::MsgPack)].clear();
+        json::to_cbor(json(msg), out[int(Encoding::Cbor)]);
+        json::to_msgpack(json(msg), out[int(Encoding::MsgPack)]);
+        out[int(Encoding::Json)] = move(msg);
+    }
+
+    // {"method":"node-edge-hello", "encoding":"cbor"} as the first message switches the connection
+    // to a binary encoding, the reply is still json and its value holds the encoding in use
+    static void hello(Connection &c, Request &req)
+    {
+        string e = req.doc().value("encoding", "json");
+        Encoding enc = e == "cbor" ? Encoding::Cbor : e == "msgpack" ? Encoding::MsgPack : Encoding::Json;
+        // binary messages can only be delimited by a length prefix
+        if (enc != Encoding::Json && c.framer.framing() != Framing::Length) {
+            enc = Encoding::Json;
+        }
+        c.write(req.reply(enc == Encoding::Cbor ? "cbor" : enc == Encoding::MsgPack ? "msgpack" : "json"));
+        c.encoding = enc;
+    }
+
+    // {"method":"node-edge-read", "topic":"node-edge-stats"} returns the metrics of the server in its value,
+    // with "payload":"prometheus" as Prometheus text
+    static void stats(Connection &c, Request &req)
+    {
+        if (req.payload == "prometheus") {
+            c.write(req.reply(Metrics::prometheus()));
+            return;
+        }
+        req.doc()["value"] = Metrics::snapshot();
+        c.write(req.encode(req.doc()));
+    }
+
+    // answer req from the reply cache, or run the route and keep the reply it writes for its ttl
+    void cached(Connection &c, Request &req, const Route &r) const
+    {
+        if (auto reply = cache->get(req.topic, req.message())) {
+            Metrics::local().cached.add();
+            c.write(*reply);
+            return;
+        }
+        string reply;
+        {
+            // a handler that throws leaves no pointer to reply behind
+            struct Copy
+            {
+                Connection &c;
+                ~Copy() { c.replyCopy = nullptr; }
+            } copy{c};
+            c.replyCopy = &reply;
+            r.handler(c, req);
+        }
+        if (!reply.empty()) {
+            cache->put(req.topic, req.message(), make_shared<const string>(move(reply)), r.opt.ttl);
+        }
+    }
+
+    const Route *route(string_view method, string_view topic) const
+    {
+        const Route &r = table[slot(routeHash(method, topic), method, topic)];
+        return r.handler ? &r : nullptr;
+    }
+
+    size_t slot(uint64_t hash, string_view method, string_view topic) const
+    {
+        size_t mask = table.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            const Route &r = table[i];
+            if (!r.handler || (r.hash == hash && r.method == method && r.topic == topic)) {
+                return i;
+            }
+        }
+    }
+
+    void grow()
+    {
+        vector<Route> old(table.size() * 2);
+        old.swap(table);
+        for (auto &r : old) {
+            if (r.handler) {
+                table[slot(r.hash, r.method, r.topic)] = move(r);
+            }
+        }
+    }
+
+    public:
+        // register or replace the handler of a (method, topic) pair, opt overrides the server's
+        // write and handler timeouts for its requests and sets its class for load shedding
+        // e.g. {.write = 5000, .handler = 200, .priority = Priority::Bulk}
+        // with a ttl identical requests get the reply of the first one until it expires or a
+        // node-edge-write to the topic comes in, the handler must write one reply per request,
+        // only node-edge-read routes take a ttl, a request that changes something must run
+        void on(string_view method, string_view topic, RouteHandler h, RouteOptions opt = {})
+        {
+            if (opt.ttl > 0 && method != "node-edge-read") {
+                LOG_WARN("ttl of %.*s %.*s ignored, only node-edge-read replies are cached",
+                         int(method.size()), method.data(), int(topic.size()), topic.data());
+                opt.ttl = 0;
+            }
+            caching = caching || opt.ttl > 0;
+            if ((used + 1) * 2 > table.size()) {
+                grow();
+            }
+            uint64_t hash = routeHash(method, topic);
+            Route &r = table[slot(hash, method, topic)];
+            if (!r.handler) {
+                used++;
+            }
+            r = Route{hash, string(method), string(topic), move(h), Metrics::topicId(method, topic), opt};
+        }
+
+        // register a handler that blocks, it runs on pool and its reply is written by the event loop
+        // once it is done, later requests of the same client wait for it so replies keep their order
+        // while the other clients are served
+        // identical node-edge-read requests that come in while one runs share its reply, unless
+        // they carry an id
+        void offload(string_view method, string_view topic, BlockingHandler h, RouteOptions opt = {}, Executor &pool = Executor::shared())
+        {
+            struct Job
+            {
+                BlockingHandler handler;
+                RouteOptions opt;
+                string invalid[3];
+                bool read, write;
+            };
+            auto job = make_shared<Job>(Job{move(h), opt, {invalidReply[0], invalidReply[1], invalidReply[2]},
+                                            method == "node-edge-read", method == "node-edge-write"});
+            caching = caching || job->read;
+
+            on(method, topic, [job, &pool, cache = cache](Connection &c, Request &req) {
+                // a reply echoing a request id is of no use to any other request
+                bool shared = job->read && req.id == 0;
+                if (shared && job->opt.ttl > 0) {
+                    if (auto reply = cache->get(req.topic, req.message())) {
+                        Metrics::local().cached.add();
+                        c.write(*reply);
+                        return;
+                    }
+                }
+                if (!c.completions) {
+                    // no event loop to hand the reply to
+                    c.write(job->handler(req));
+                    return;
+                }
+                c.awaiting = true;
+                c.completions->expect();
+                shared_ptr<ReplyCache::Flight> flight;
+                if (shared && !(flight = cache->join(req.topic, req.message(), {c.completions, c.fd, c.id}))) {
+                    // an identical read is running, its reply comes for this one too
+                    Metrics::local().coalesced.add();
+                    return;
+                }
+                pool.submit([job, cache, flight, q = c.completions, fd = c.fd, id = c.id, enc = c.encoding,
+                             topic = string(req.topic), msg = string(req.message())] {
+                    shared_ptr<const string> reply;
+                    bool valid = true;
+                    auto start = chrono::steady_clock::now();
+                    try
+                    {
+                        Request r(msg, enc);
+                        auto out = job->handler(r);
+                        reply = make_shared<const string>(out.data(), out.size());
+                    }
+                    catch (json::exception& ex)
+                    {
+                        Metrics::local().errors.add();
+                        LOG_WARN("json error: %s", ex.what());
+                        reply = make_shared<const string>(job->invalid[int(enc)]);
+                        valid = false;
+                    }
+                    int limit = job->opt.handler;
+                    auto took = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+                    if (limit >= 0 && took > limit) {
+                        Metrics::local().timeouts.add();
+                        LOG_WARN("offloaded handler took %lld ms, over its %d ms limit", (long long)took, limit);
+                    }
+                    // the reply was copied out of the pool thread's arena
+                    Arena::local().reset();
+                    if (job->write) {
+                        cache->invalidate(topic);
+                    }
+                    if (!flight) {
+                        q->push(new Completion{nullptr, fd, id, reply});
+                        return;
+                    }
+                    // one reply for every connection that asked the same
+                    for (auto &w : cache->land(topic, msg, flight, reply, valid ? job->opt.ttl : 0)) {
+                        w.queue->push(new Completion{nullptr, w.fd, w.conn, reply});
+                    }
+                });
+            }, opt);
+            table[slot(routeHash(method, topic), method, topic)].offloaded = true;
+        }
+
+        // register a write that goes to log before it is applied, h applies it and returns the
+        // reply, it runs on the log's committer thread once the log has the request on disk,
+        // in log order, the writes of all clients within the log's batch window share one
+        // fdatasync, a write whose sync failed is neither applied nor replayed and gets the
+        // failed reply, a client's later replies are held behind the ack so they keep their
+        // order, reads it sent meanwhile see the value from before the write
+        void logged(string_view method, string_view topic, WriteLog &log, BlockingHandler h, RouteOptions opt = {})
+        {
+            struct Job
+            {
+                BlockingHandler handler;
+                string failed[3];
+                string invalid[3];
+            };
+            auto job = make_shared<Job>(Job{h, {failedReply[0], failedReply[1], failedReply[2]},
+                                            {invalidReply[0], invalidReply[1], invalidReply[2]}});
+
+            on(method, topic, [job, &log, cache = cache](Connection &c, Request &req) {
+                if (!c.completions) {
+                    // no event loop to hand the ack to
+                    uint64_t seq = log.append(req.topic, req.encoding(), req.message());
+                    if (seq == 0 || !log.sync(seq)) {
+                        Metrics::local().errors.add();
+                        c.write(job->failed[int(c.encoding)]);
+                        return;
+                    }
+                    c.write(job->handler(req));
+                    cache->invalidate(req.topic);
+                    return;
+                }
+                // the reply and whatever the client gets after it wait for the ack, the client
+                // goes on sending meanwhile
+                c.held.push_back({});
+                c.completions->expect();
+                uint64_t seq = log.append(req.topic, req.encoding(), req.message(),
+                                          [job, cache, q = c.completions, fd = c.fd, id = c.id, enc = c.encoding,
+                                           msg = string(req.message())](bool ok) {
+                    shared_ptr<const string> reply;
+                    if (!ok) {
+                        Metrics::local().errors.add();
+                        reply = make_shared<const string>(job->failed[int(enc)]);
+                    }
+                    else {
+                        try
+                        {
+                            Request r(msg, enc);
+                            auto out = job->handler(r);
+                            reply = make_shared<const string>(out.data(), out.size());
+                            cache->invalidate(r.topic);
+                        }
+                        catch (json::exception& ex)
+                        {
+                            Metrics::local().errors.add();
+                            LOG_WARN("json error in logged write: %s", ex.what());
+                            reply = make_shared<const string>(job->invalid[int(enc)]);
+                        }
+                        // the reply was copied out of the committer thread's arena
+                        Arena::local().reset();
+                    }
+                    q->push(new Completion{nullptr, fd, id, reply, true});
+                });
+                if (seq == 0) {
+                    c.held.pop_back();
+                    c.completions->abandon();
+                    Metrics::local().errors.add();
+                    c.write(job->failed[int(c.encoding)]);
+                }
+            }, opt);
+            table[slot(routeHash(method, topic), method, topic)].apply = move(h);
+        }
+
+        // apply the writes in log again through the routes registered with logged(), call it
+        // once at startup before the server runs
+        void replay(WriteLog &log) const
+        {
+            log.replay([this](string_view msg, Encoding enc) {
+                try
+                {
+                    Request req(msg, enc);
+                    if (auto r = route(req.method, req.topic); r && r->apply) {
+                        r->apply(req);
+                    }
+                }
+                catch (json::exception& ex)
+                {
+                    LOG_WARN("json error in logged write: %s", ex.what());
+                }
+                Arena::local().reset();
+            });
+        }
+
+        // handler for (method, topic) or nullptr, one hash and usually one probe
+        const RouteHandler *find(string_view method, string_view topic) const
+        {
+            const Route *r = route(method, topic);
+            return r ? &r->handler : nullptr;
+        }
+
+        Router()
+        {
+            prebuild(unknownReply, unknownReply[0]);
+            prebuild(invalidReply, invalidReply[0]);
+            prebuild(busyReply, busyReply[0]);
+            prebuild(failedReply, failedReply[0]);
+            on("node-edge-read", "node-edge-stats", stats, {.priority = Priority::Control});
+        }
+
+        // let clients subscribe to a cached topic with node-edge-subscribe and stop with node-edge-unsubscribe,
+        // {"method":"node-edge-subscribe", "topic":"random-data", "deadband":5, "interval":100}
+        void publish(string_view topic, CachedTopic *t)
+        {
+            on("node-edge-subscribe", topic, [t](Connection &c, Request &req) {
+                if (!c.subs) {
+                    c.write(req.reply("subscriptions are not available on this connection"));
+                    return;
+                }
+                c.subs->add(c, req, t, req.deadband, req.interval);
+            });
+            on("node-edge-unsubscribe", topic, [t](Connection &c, Request &req) {
+                bool had = c.subs && c.subs->remove(c, t);
+                c.write(req.reply(had ? "unsubscribed" : "not subscribed"));
+            });
+        }
+
+        // replies sent for unknown topics and for messages that are not json
+        void setUnknownReply(string msg)
+        {
+            prebuild(unknownReply, move(msg));
+        }
+
+        void setInvalidReply(string msg)
+        {
+            prebuild(invalidReply, move(msg));
+        }
+
+        // reply sent when a logged write could not be made durable
+        void setFailedReply(string msg)
+        {
+            prebuild(failedReply, move(msg));
+        }
+
+        // reply sent instead of handling a request shed under load
+        void setBusyReply(string msg)
+        {
+            prebuild(busyReply, move(msg));
+        }
+
+        void dispatch(Connection &c, string_view msg) const
+        {
+            bool first = c.received++ == 0;
+            Metrics &m = Metrics::local();
+            uint64_t t = Metrics::clock();
+            m.requests.add();
+            try
+            {
+                Request req(msg, c.encoding);
+                t = Metrics::lap(m.parse, t);
+                if (first && req.method == "node-edge-hello") {
+                    hello(c, req);
+                }
+                else if (auto r = route(req.method, req.topic); r && r->opt.priority < c.admit) {
+                    // the server is over its limits, the precomputed reply costs nothing to send
+                    m.shed.add();
+                    c.write(busyReply[int(c.encoding)]);
+                }
+                else if (r) {
+                    m.topics[r->stat].add();
+                    c.limits = r->opt;
+                    if (r->opt.ttl > 0 && !r->offloaded && req.id == 0) {
+                        cached(c, req, *r);
+                    }
+                    else {
+                        r->handler(c, req);
+                    }
+                    if (caching && req.method == "node-edge-write") {
+                        cache->invalidate(req.topic);
+                    }
+                    Metrics::lap(m.handler, t);
+                }
+                else {
+                    m.unknown.add();
+                    c.write(unknownReply[int(c.encoding)]);
+                }
+            }
+            catch (json::exception& ex)
+            {
+                // rcvd data is not a json string or a handler used a field of the wrong type
+                m.errors.add();
+                LOG_WARN("json error: %s", ex.what());
+                c.write(invalidReply[int(c.encoding)]);
+            }
+            // the reply was copied into the output queue, the request is done
+            Arena::local().reset();
+        }
+
+        // Router as the Server request handler, each server or shard gets its own copy of the table
+        operator RequestHandler() const
+        {
+            return [r = *this](Connection &c, string_view msg) { r.dispatch(c, msg); };
+        }
+};
+
+}
+
@@ -8,13 +8,29 @@
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/fcntl.h>
-#include <future>
+#include <poll.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <sys/socket.h>
 #include <stdio.h>
 #include "socketerror.h"
+#include "log.h"
+#include "connection.h"
+#include "coro.h"
+#include "handoff.h"
+#include "subscribe.h"
+#include "unixsocket.h"
+#include "uring.h"
 
 #define MAX_CONN        16
 #define MAX_EVENTS      32
@@ -24,18 +40,71 @@ namespace Tcp {
 
 using namespace std;
 
+// reactor mode admission limits of one event loop, each shard of a ShardedServer has its own, 0 is none
+// a connection over inflight or output is not read until its replies drain, the client feels it as
+// tcp backpressure, over 3/4 of a total limit Bulk requests get the busy reply and over the limit
+// Normal ones too, Control requests are always handled
+struct Limits
+{
+    int backlog = SOMAXCONN;        // connections waiting in the kernel to be accepted
+    size_t connections = 0;         // clients beyond it are closed right after accept
+    size_t inflight = 256;          // requests per connection whose replies are not sent yet
+    size_t output = 1 << 20;        // queued reply bytes per connection
+    size_t totalInflight = 0;
+    size_t totalOutput = 64 << 20;
+};
+
 class Server
 {
-    int i, n, epfd, nfd;
-    int sockfd, newsockfd, rv;
+    int i, n, epfd = -1, nfd;
+    int sockfd = -1, newsockfd = -1, rv;
+    int wakefd = -1;
     uint16_t PORT; // or in_port_t PORT where in_port_t is equivalent to the type uint16_t as defined in <inttypes.h> .
     int listenF = false, ServerLoop = false;
+    bool reuseport = false;
+    int family = AF_INET;
+    string unixPath;    // filesystem path of a unix domain server, removed again by the destructor
+    int shmfd = -1;     // listening socket of listenShm()
+    string shmPath;
+    uint64_t shmCapacity = SHM_RING_SIZE;
+    unordered_map<int, int> shmWake;    // server eventfd of a shm channel -> its connection
+    unique_ptr<Subscriptions> subs;     // woken through wakefd when a subscribed topic changes
+    unique_ptr<CompletionQueue> completions;    // replies of offloaded handlers, woken through wakefd
+    uint64_t connSerial = 0;
+    function<bool(const ucred&)> peerCheck;
+    bool uringWanted = false;
+    vector<Connection*> sendQueue;      // io_uring: connections whose output goes out with this batch
+    vector<int> released;               // io_uring: closed connections with nothing left in flight
+    int inflight = 0;                   // io_uring: submitted requests that have not completed yet
+    int readTimeout = 1000;
+    TimerWheel timers;                  // reactor mode deadlines of the connections
+    Timeouts timeouts;
+    vector<int> expired;                // connections whose timer fired, checked by the loop
+    Limits limits;
+    size_t totalInflight = 0;           // sums over the connections, see settle()
+    size_t totalOutput = 0;
     string IP;
     socklen_t clen;
     sockaddr_in server_addr{}, client_addr{}; // structure that specifies a transport address and port for the AF_INET address family
     struct epoll_event ev;
 	struct epoll_event events[MAX_EVENTS];
 
+    // reactor mode state, see run()
+    unordered_map<int, unique_ptr<Connection>> conns;
+    RequestHandler handler;
+    StreamHandler streamHandler;
+    vector<shared_ptr<Stream>> ready;   // coroutines whose wait is over, resumed by the loop
+    Framing framing = Framing::Auto;
+    mutable Framer framer;  // input buffer of the single client used by read(), written to by write()
+    atomic<bool> stopped{false};
+
+    // hot restart, see drain() and adopt()
+    vector<HandedConnection> handed;    // from the previous instance, joined when run() starts
+    function<void(const HandedConnection&)> keep;   // takes the connections that go to the next one
+    int drainMs = HANDOFF_DRAIN;
+    atomic<bool> draining{false};
+    int64_t drainUntil = 0;             // wheel ms, 0 until the loop started draining
+
     void epoll_ctl_add(int epfd, int fd, uint32_t events)
     {
 	    struct epoll_event ev;
@@ -49,7 +118,7 @@ class Server
 
     int setnonblocking(int sfd)
     {
-	    if (fcntl(sfd, F_SETFD, fcntl(sfd, F_GETFD, 0) | O_NONBLOCK) == -1) {
+	    if (fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
 		    return -1;
 	    }
 	    return 0;
@@ -79,44 +148,1317 @@ class Server
 
 	        int reuse = 1; //reuse socket
 	        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+	        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) < 0) {
+	            throw SocketError();
+	        }
           
 	        if(bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0){
 	            throw SocketError();
 	        }
-	        else
-	        {
-	            listen(sockfd, MAX_CONN);
-                //epfd = epoll_create(1); // alternate api
-                epfd = epoll_create1(0);
-	            epoll_ctl_add(epfd, sockfd, EPOLLIN | EPOLLOUT | EPOLLET);
-	            clen = sizeof(client_addr);
+	        initListener();
+	        return 0;
+        }
+        catch (SocketError& e)
+        {
+	        LOG_ERROR("socket initialize error: %s", e.what());
+	        closeHandler();
+            return 1;
+        }
+    }
+
+    int initUnixSocket(const string &path)
+    {
+        IP = ip = path;
+        PORT = port = 0;
+        family = AF_UNIX;
+
+        try
+        {
+            sockaddr_un addr;
+            socklen_t len = unixAddress(path, addr);
+	        sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	        if (sockfd < 0) {
+	            throw SocketError();
 	        }
+            if (path[0] != '@') {
+                unlink(path.c_str()); // stale socket file of a previous run
+            }
+	        if (bind(sockfd, (struct sockaddr *)&addr, len) < 0) {
+	            throw SocketError();
+	        }
+            if (path[0] != '@') {
+                unixPath = path;
+            }
+	        initListener();
 	        return 0;
         }
         catch (SocketError& e)
         {
-	        cerr << "socket initialize error: " << e.what() << endl;
+	        LOG_ERROR("socket initialize error: %s", e.what());
 	        closeHandler();
             return 1;
         }
     }
 
+    // listen on the bound sockfd and set up the epoll instance
+    void initListener()
+    {
+	    listen(sockfd, limits.backlog);
+        //epfd = epoll_create(1); // alternate api
+        epfd = epoll_create1(0);
+	    epoll_ctl_add(epfd, sockfd, EPOLLIN | EPOLLOUT | EPOLLET);
+	    clen = sizeof(client_addr);
+        // lets stop() interrupt a blocking epoll_wait() in run()
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	    epoll_ctl_add(epfd, wakefd, EPOLLIN);
+        subs = make_unique<Subscriptions>(wakefd);
+        completions = make_unique<CompletionQueue>(wakefd);
+    }
+
+    // false if a unix domain peer fails the setPeerCheck() test, cred is filled for unix domain peers
+    bool acceptPeer(int fd, ucred &cred)
+    {
+        if (family != AF_UNIX) {
+            return true;
+        }
+        if (!peerCredentials(fd, cred)) {
+            return false;
+        }
+        return !peerCheck || peerCheck(cred);
+    }
+
     void closeHandler() const
     {
         end();
     }
 
+    // accept every pending client until the listening socket returns EAGAIN
+    void acceptConnections()
+    {
+        for (;;)
+        {
+            sockaddr_storage addr{};
+            socklen_t len = sizeof(addr);
+            int fd = accept4(sockfd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("accept error: %s", strerror(errno));
+                }
+                return;
+            }
+            if (!admitConnection(fd)) {
+                continue;
+            }
+            ucred cred{0, uid_t(-1), gid_t(-1)};
+            if (!acceptPeer(fd, cred)) {
+                LOG_WARN("unix peer pid %d uid %u rejected", int(cred.pid), unsigned(cred.uid));
+                close(fd);
+                continue;
+            }
+            if (family == AF_INET) {
+                int nodelay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+            }
+            auto c = make_unique<Connection>(fd, epfd, addr, framing);
+            c->cred = cred;
+            c->subs = subs.get();
+            c->completions = completions.get();
+            c->id = ++connSerial;
+            track(*c);
+            conns[fd] = move(c);
+            epoll_ctl_add(epfd, fd, EPOLLIN | EPOLLET | EPOLLRDHUP);
+            Metrics::local().accepted.add();
+            startStream(*conns[fd]);
+        }
+    }
+
+    // run a new connection as a coroutine if the server has a StreamHandler
+    void startStream(Connection &c)
+    {
+        if (!streamHandler) {
+            return;
+        }
+        c.stream = make_shared<Stream>(c, ready, timers);
+        c.stream->start(streamHandler(*c.stream));
+    }
+
+    // false if the loop is at its connection limit, fd is closed then
+    bool admitConnection(int fd)
+    {
+        if (limits.connections == 0 || conns.size() < limits.connections) {
+            return true;
+        }
+        Metrics::local().rejected.add();
+        LOG_DEBUG("connection limit %zu reached, client rejected", limits.connections);
+        close(fd);
+        return false;
+    }
+
+    // drain the socket (edge triggered) and pass every complete message to the handler
+    void readConnection(Connection &c)
+    {
+        if (c.shm) {
+            // nothing is expected on the control socket of a shm channel but its close
+            c.closing = c.framer.fill(c.fd) <= 0;
+            c.framer = Framer(Framing::Raw);
+            return;
+        }
+        if (c.paused) {
+            // the rest stays in the socket, resume() reads it
+            return;
+        }
+
+        // on a closed peer, serve what was received then close
+        size_t before = c.framer.pending();
+        if (c.framer.fill(c.fd) <= 0) {
+            c.closing = true;
+        }
+        Metrics::local().bytesIn.add(c.framer.pending() - before);
+        c.active = timers.now();
+        dispatch(c);
+    }
+
+    // give a new connection its timer, the callback only notes it, the loop decides what expired
+    void track(Connection &c)
+    {
+        c.active = timers.now();
+        c.timer.fire = [this, fd = c.fd] { expired.push_back(fd); };
+        arm(c, false);
+    }
+
+    // set the connection timer to its earliest deadline, called after anything happened on it
+    // progress is true when complete messages were taken from the input
+    void arm(Connection &c, bool progress)
+    {
+        if (c.shm || c.failed || (c.uring && c.uring->closing)) {
+            timers.cancel(c.timer);
+            return;
+        }
+        int64_t now = timers.now();
+
+        // the read deadline runs from the start of a message, trickling bytes do not extend it
+        if (c.framer.pending() == 0 || c.paused) {
+            c.readSince = 0;
+        }
+        else if (progress || c.readSince == 0) {
+            c.readSince = now;
+        }
+
+        // the write deadline runs while the client takes none of its queued replies
+        bool moved = c.out.sent() != c.sentSeen;
+        if (moved) {
+            c.sentSeen = c.out.sent();
+            c.active = now;
+        }
+        if (c.out.empty()) {
+            c.writeSince = 0;
+        }
+        else if (c.writeSince == 0 || moved) {
+            c.writeSince = now;
+            c.writeLimit = c.limits.write >= 0 ? c.limits.write : timeouts.write;
+        }
+
+        // idle is no traffic either way and no reply being made, replies still queued are up to the write deadline
+        int64_t due = INT64_MAX;
+        if (timeouts.idle >= 0 && c.writeSince == 0 && !c.awaiting && c.held.empty()) {
+            due = c.active + timeouts.idle;
+        }
+        if (c.readSince && timeouts.read >= 0) {
+            due = min(due, c.readSince + timeouts.read);
+        }
+        if (c.writeSince && c.writeLimit >= 0) {
+            due = min(due, c.writeSince + c.writeLimit);
+        }
+        if (due == INT64_MAX) {
+            timers.cancel(c.timer);
+        }
+        else if (!c.timer.armed() || c.timer.due != due) {
+            timers.schedule(c.timer, due);
+        }
+    }
+
+    // the timer of c fired, true if a deadline passed and c must be closed, otherwise it is re-armed
+    bool expire(Connection &c)
+    {
+        if (c.uring && c.uring->closing) {
+            return false;
+        }
+        int64_t now = timers.now();
+        Metrics &m = Metrics::local();
+        if (c.writeSince && c.writeLimit >= 0 && now >= c.writeSince + c.writeLimit) {
+            m.timeouts.add();
+            LOG_WARN("write timeout, connection %d took none of its %zu queued bytes in %d ms", c.fd, c.out.size(), c.writeLimit);
+            // reset instead of leaving the kernel to trickle its send buffer to the stalled client
+            linger l{1, 0};
+            setsockopt(c.fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        }
+        else if (c.readSince && timeouts.read >= 0 && now >= c.readSince + timeouts.read) {
+            m.timeouts.add();
+            LOG_WARN("read timeout, connection %d left a message incomplete for %d ms", c.fd, timeouts.read);
+        }
+        else if (timeouts.idle >= 0 && c.writeSince == 0 && !c.awaiting && c.held.empty() && now >= c.active + timeouts.idle) {
+            LOG_DEBUG("connection %d idle for %d ms, closing", c.fd, timeouts.idle);
+        }
+        else {
+            arm(c, false);
+            return false;
+        }
+        c.failed = true;
+        return true;
+    }
+
+    // over a per connection limit, or waiting for the reply of an offloaded handler, a shm
+    // client also while its reply ring is full
+    bool overLimits(const Connection &c) const
+    {
+        return c.awaiting || (c.shm && c.shm->backlog() > 0) || (limits.inflight && c.inflight >= limits.inflight) ||
+               (limits.output && c.output() >= limits.output);
+    }
+
+    // the lowest class of requests the loop still handles
+    Priority admission() const
+    {
+        auto over = [](size_t total, size_t limit, size_t num, size_t den) {
+            return limit && total * den >= limit * num;
+        };
+        if (over(totalInflight, limits.totalInflight, 1, 1) || over(totalOutput, limits.totalOutput, 1, 1)) {
+            return Priority::Control;
+        }
+        if (over(totalInflight, limits.totalInflight, 3, 4) || over(totalOutput, limits.totalOutput, 3, 4)) {
+            return Priority::Normal;
+        }
+        return Priority::Bulk;
+    }
+
+    // bring the loop totals up to date with c, called whenever its output queue may have changed
+    // true when c is paused and has drained enough to be read again
+    bool settle(Connection &c)
+    {
+        size_t output = c.output();
+        if (output == 0 && c.held.empty()) {
+            // every reply went out
+            c.inflight = 0;
+        }
+        if (c.stream) {
+            c.stream->drained();
+        }
+        totalInflight = totalInflight - c.countedInflight + c.inflight;
+        totalOutput = totalOutput - c.countedOutput + output;
+        c.countedInflight = c.inflight;
+        c.countedOutput = output;
+        return c.paused && !overLimits(c) && (limits.output == 0 || output < limits.output / 2);
+    }
+
+    // c is going away, its share leaves the loop totals
+    void unsettle(Connection &c)
+    {
+        totalInflight -= c.countedInflight;
+        totalOutput -= c.countedOutput;
+        c.countedInflight = c.countedOutput = 0;
+    }
+
+    // read a paused connection again once its replies drained, a shm client goes on with the
+    // requests left in its ring
+    void resume(Connection &c)
+    {
+        if (c.shm) {
+            readShm(c);
+            return;
+        }
+        if (settle(c)) {
+            c.paused = false;
+            readConnection(c);
+        }
+    }
+
+    // ms the loop may wait for events before a timer or a held back update is due
+    int waitTimeout() const
+    {
+        if (!ready.empty()) {
+            return 0;
+        }
+        int a = timers.timeout(), b = subs->timeout();
+        if (drainUntil) {
+            // connections still busy at the deadline are closed
+            int d = int(max<int64_t>(drainUntil - timers.now(), 0));
+            a = a < 0 ? d : min(a, d);
+        }
+        return a < 0 ? b : b < 0 ? a : min(a, b);
+    }
+
+    // pass every complete message received on c to the handler
+    void dispatch(Connection &c)
+    {
+        Metrics &m = Metrics::local();
+        bool progress = false;
+        for (;;)
+        {
+            // replies to a batch of pipelined requests go out together with one writev
+            c.corked = true;
+            c.admit = admission();
+            try
+            {
+                // a half-closed peer still gets the replies to everything it sent
+                string_view msg;
+                // a coroutine that is not waiting for a request holds the rest back too
+                c.paused = c.paused || overLimits(c);
+                while (!c.paused && c.next(msg)) {
+                    progress = true;
+                    c.limits = {};
+                    auto start = chrono::steady_clock::now();
+                    if (c.stream) {
+                        c.stream->deliver(msg);
+                    }
+                    else {
+                        handler(c, msg);
+                    }
+                    // a synchronous handler cannot be stopped, an overrun is reported so it can be fixed
+                    int limit = c.limits.handler >= 0 ? c.limits.handler : timeouts.handler;
+                    auto took = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+                    if (limit >= 0 && took > limit) {
+                        m.timeouts.add();
+                        LOG_WARN("handler took %lld ms, over its %d ms limit", (long long)took, limit);
+                    }
+                    // stop taking requests from a client that does not take its replies
+                    c.inflight++;
+                    c.paused = overLimits(c);
+                }
+            }
+            catch (SocketError& e)
+            {
+                m.errors.add();
+                LOG_ERROR("request handler error: %s", e.what());
+                c.closing = true;
+            }
+            c.corked = false;
+            uint64_t t = Metrics::clock();
+            c.flush();
+            Metrics::lap(m.write, t);
+            if (!settle(c)) {
+                break;
+            }
+            // the socket took the whole batch, go on with the rest that was read
+            c.paused = false;
+        }
+        arm(c, progress);
+    }
+
+    void closeConnection(int fd)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        auto it = conns.find(fd);
+        if (it != conns.end() && it->second->shm) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, it->second->shm->serverWake, NULL);
+            shmWake.erase(it->second->shm->serverWake);
+        }
+        if (it != conns.end()) {
+            subs->drop(*it->second);
+            unsettle(*it->second);
+            if (it->second->stream) {
+                it->second->stream->close();
+            }
+            Metrics::local().closed.add();
+        }
+        conns.erase(fd);
+    }
+
+    void handleEvent(const epoll_event &e)
+    {
+        int fd = e.data.fd;
+        if (fd == sockfd) {
+            acceptConnections();
+            return;
+        }
+        if (fd == wakefd) {
+            uint64_t v;
+            while (::read(wakefd, &v, sizeof(v)) > 0) {}
+            subs->poll();
+            armUpdated();
+            return;
+        }
+        if (fd == shmfd) {
+            acceptShm();
+            return;
+        }
+        if (auto w = shmWake.find(fd); w != shmWake.end()) {
+            int cfd = w->second;
+            Connection &c = *conns[cfd];
+            readShm(c);
+            if (c.done()) {
+                closeConnection(cfd);
+            }
+            return;
+        }
+
+        auto it = conns.find(fd);
+        if (it == conns.end()) {
+            return;
+        }
+        Connection &c = *it->second;
+        if (e.events & EPOLLIN) {
+            readConnection(c);
+        }
+        if (e.events & EPOLLOUT) {
+            c.flush();
+            resume(c);
+            arm(c, false);
+        }
+        if (e.events & EPOLLRDHUP) {
+            c.closing = true;
+        }
+        if (e.events & (EPOLLHUP | EPOLLERR)) {
+            c.failed = true;
+        }
+        if (c.done()) {
+            closeConnection(fd);
+        }
+    }
+
+    // connections that got subscription updates outside of a request
+    void armUpdated()
+    {
+        for (Connection *c : subs->sent) {
+            settle(*c);
+            arm(*c, false);
+        }
+        subs->sent.clear();
+    }
+
+    // write the replies of offloaded handlers, then let each connection go on with its next requests
+    // through resume, a connection that closed meanwhile loses its reply
+    template<class Resume>
+    void complete(Resume resume)
+    {
+        for (Completion *done = completions->take(); done;) {
+            auto it = conns.find(done->fd);
+            if (it != conns.end() && it->second->id == done->conn) {
+                Connection &c = *it->second;
+                if (done->release && !c.held.empty()) {
+                    c.release(*done->reply);
+                    resume(c);
+                }
+                else if (!done->release && c.awaiting) {
+                    c.awaiting = false;
+                    c.write(*done->reply);
+                    resume(c);
+                }
+            }
+            Completion *n = done->next;
+            delete done;
+            done = n;
+        }
+    }
+
+    // resume the coroutines whose wait is over, then let each connection go on through resume
+    template<class Resume>
+    void wakeStreams(Resume resume)
+    {
+        while (!ready.empty()) {
+            auto woken = move(ready);
+            ready.clear();
+            for (auto &st : woken) {
+                st->run();
+                if (!st->closed()) {
+                    resume(st->connection());
+                }
+            }
+        }
+    }
+
+    // move the clock on and close the connections past a deadline
+    template<class Close>
+    void reap(Close close)
+    {
+        timers.advance();
+        for (int fd : expired) {
+            auto it = conns.find(fd);
+            if (it != conns.end() && expire(*it->second)) {
+                close(*it->second);
+            }
+        }
+        expired.clear();
+    }
+
+    void runEpoll()
+    {
+        takeHanded(epfd, [this](Connection &c) { epoll_ctl_add(epfd, c.fd, EPOLLIN | EPOLLET | EPOLLRDHUP); });
+
+        while (!stopped)
+        {
+            nfd = epoll_wait(epfd, events, MAX_EVENTS, waitTimeout());
+            if (nfd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw SocketError();
+            }
+            reap([this](Connection &c) { closeConnection(c.fd); });
+
+            for (i = 0; i < nfd; i++) {
+                handleEvent(events[i]);
+            }
+            auto next = [this](Connection &c) {
+                resume(c);
+                arm(c, false);
+                if (c.done()) {
+                    closeConnection(c.fd);
+                }
+            };
+            complete(next);
+            wakeStreams(next);
+
+            // updates held back by their interval or a full output queue
+            subs->tick();
+            armUpdated();
+            Arena::local().reset();
+
+            if (draining) {
+                drainConnections([this] {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
+                    if (shmfd >= 0) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, shmfd, NULL);
+                    }
+                }, [this](Connection &c, bool quiet) {
+                    if (quiet && keep && handable(c)) {
+                        handOver(c);
+                    }
+                    else {
+                        closeConnection(c.fd);
+                    }
+                });
+                if (conns.empty()) {
+                    stopped = true;
+                }
+            }
+        }
+    }
+
+    // true if the next instance can go on with c, it gets no more than its framing and
+    // encoding, subscribers and coroutines are closed and their clients reconnect
+    bool handable(Connection &c) const
+    {
+        return !c.shm && !c.stream && !c.closing && !c.failed && !subs->subscribed(c);
+    }
+
+    // let go of a quiet connection for the next instance, its socket stays open for keep
+    void handOver(Connection &c)
+    {
+        int fd = c.fd;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        timers.cancel(c.timer);
+        unsettle(c);
+        keep(HandedConnection{fd, c.framer.framing(), c.framer.newlines(), c.encoding, c.received > 0});
+        c.fd = -1;
+        Metrics::local().closed.add();
+        conns.erase(fd);
+    }
+
+    // the server hands over to the next instance, stop accepting through unlisten, then let
+    // each connection go through release as soon as it is quiet, with nothing in flight, and
+    // at the deadline those that are not, release closes them then
+    template<class Unlisten, class Release>
+    void drainConnections(Unlisten unlisten, Release release)
+    {
+        if (drainUntil == 0) {
+            unlisten();
+            drainUntil = timers.now() + max(drainMs, 1);
+        }
+        bool late = timers.now() >= drainUntil;
+        vector<int> fds;
+        for (auto &p : conns) {
+            fds.push_back(p.first);
+        }
+        for (int fd : fds) {
+            Connection &c = *conns[fd];
+            if (c.uring && c.uring->closing) {
+                continue;
+            }
+            bool quiet = c.out.empty() && !c.awaiting && c.held.empty() && c.framer.pending() == 0;
+            if (late || quiet || c.shm) {
+                if (!quiet && !c.shm) {
+                    LOG_WARN("connection %d still busy at the end of the drain, closing", fd);
+                }
+                release(c, quiet);
+            }
+        }
+    }
+
+    // connections handed over by the previous instance join the loop like accepted ones,
+    // add registers one with the loop, see adopt()
+    template<class Add>
+    void takeHanded(int loopfd, Add add)
+    {
+        for (auto &h : handed) {
+            sockaddr_storage addr{};
+            socklen_t len = sizeof(addr);
+            getpeername(h.fd, (struct sockaddr *) &addr, &len);
+            ucred cred{0, uid_t(-1), gid_t(-1)};
+            if (h.accepted) {
+                // accepted by HandOff::take(), it goes through the checks of acceptConnections()
+                if (!admitConnection(h.fd)) {
+                    continue;
+                }
+                if (!acceptPeer(h.fd, cred)) {
+                    LOG_WARN("unix peer pid %d uid %u rejected", int(cred.pid), unsigned(cred.uid));
+                    close(h.fd);
+                    continue;
+                }
+                if (family == AF_INET) {
+                    int nodelay = 1;
+                    setsockopt(h.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+                }
+            }
+            else if (addr.ss_family == AF_UNIX) {
+                peerCredentials(h.fd, cred);
+            }
+            auto c = make_unique<Connection>(h.fd, loopfd, addr, h.accepted ? framing : h.framing);
+            c->cred = cred;
+            c->framer.setNewlines(h.delimited);
+            c->encoding = h.encoding;
+            c->received = h.negotiated ? 1 : 0;
+            c->subs = subs.get();
+            c->completions = completions.get();
+            c->id = ++connSerial;
+            Connection &r = *c;
+            conns[h.fd] = move(c);
+            add(r);
+            track(r);
+            Metrics::local().accepted.add();
+            startStream(r);
+        }
+        handed.clear();
+    }
+
+#if EDGE_URING
+    enum UringOp : uint64_t
+    {
+        OpAccept = 1,
+        OpEvents,
+        OpRecv,
+        OpSend,
+        OpCancel
+    };
+
+    // completion user data, the fd of a connection stays open until its last completion
+    static uint64_t tag(UringOp op, int fd)
+    {
+        return uint64_t(op) << 32 | uint32_t(fd);
+    }
+
+    // a client accepted by the ring, its reads and writes go through the ring as well
+    void uringAccept(Uring &ring, int fd)
+    {
+        if (!admitConnection(fd)) {
+            return;
+        }
+        ucred cred{0, uid_t(-1), gid_t(-1)};
+        if (!acceptPeer(fd, cred)) {
+            LOG_WARN("unix peer pid %d uid %u rejected", int(cred.pid), unsigned(cred.uid));
+            close(fd);
+            return;
+        }
+        if (family == AF_INET) {
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+        }
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        getpeername(fd, (struct sockaddr *) &addr, &len);
+        auto c = make_unique<Connection>(fd, -1, addr, framing);
+        c->cred = cred;
+        c->subs = subs.get();
+        c->completions = completions.get();
+        c->id = ++connSerial;
+        c->uring = make_unique<UringIo>(&sendQueue);
+        c->uring->receiving = true;
+        track(*c);
+        conns[fd] = move(c);
+        ring.recv(fd, tag(OpRecv, fd));
+        inflight++;
+        Metrics::local().accepted.add();
+        startStream(*conns[fd]);
+    }
+
+    void uringSend(Uring &ring, Connection &c)
+    {
+        UringIo &u = *c.uring;
+        u.msg = msghdr{};
+        u.msg.msg_iov = u.iov;
+        u.msg.msg_iovlen = c.out.gather(u.iov, MAX_IOV);
+        u.sending = true;
+        ring.sendmsg(c.fd, &u.msg, tag(OpSend, c.fd));
+        inflight++;
+        arm(c, false);
+    }
+
+    // a paused connection whose replies drained takes requests again
+    void uringResume(Uring &ring, Connection &c)
+    {
+        if (!settle(c)) {
+            return;
+        }
+        UringIo &u = *c.uring;
+        c.paused = false;
+        dispatch(c);
+        // while the cancelled recv has not completed yet, its completion arms it again
+        if (!c.paused && u.paused && !u.receiving) {
+            u.paused = false;
+            ring.recv(c.fd, tag(OpRecv, c.fd));
+            u.receiving = true;
+            inflight++;
+        }
+    }
+
+    // cancel what is in flight on c, it is released with its last completion
+    void uringClose(Uring &ring, Connection &c)
+    {
+        UringIo &u = *c.uring;
+        if (u.closing) {
+            return;
+        }
+        u.closing = true;
+        u.handing = false;
+        timers.cancel(c.timer);
+        subs->drop(c);
+        if (c.stream) {
+            c.stream->close();
+        }
+        if (u.receiving || u.sending) {
+            ring.cancel(c.fd, tag(OpCancel, c.fd));
+            inflight++;
+        }
+        else {
+            released.push_back(c.fd);
+        }
+    }
+
+    // let go of a quiet connection for the next instance once the ring has nothing on it,
+    // its recv is cancelled first, it is released like a closed one but its socket stays open
+    void uringHandOver(Uring &ring, Connection &c)
+    {
+        UringIo &u = *c.uring;
+        if (u.receiving) {
+            if (!u.handing) {
+                u.handing = true;
+                ring.cancelRequest(tag(OpRecv, c.fd), tag(OpCancel, c.fd));
+                inflight++;
+            }
+            return;
+        }
+        if (u.sending) {
+            return;
+        }
+        u.handing = true;
+        u.closing = true;
+        timers.cancel(c.timer);
+        released.push_back(c.fd);
+    }
+
+    // the epoll instance is ready, serve what it has without blocking
+    void uringEvents()
+    {
+        // the multishot poll fires on new wakeups only, an eventfd signalled again while its
+        // event was handled, e.g. by a shm client, is only seen by asking epoll once more
+        do {
+            nfd = epoll_wait(epfd, events, MAX_EVENTS, 0);
+            for (i = 0; i < nfd; i++) {
+                handleEvent(events[i]);
+            }
+        } while (nfd > 0);
+    }
+
+    void uringComplete(Uring &ring, const io_uring_cqe &e)
+    {
+        bool more = e.flags & IORING_CQE_F_MORE;
+        if (!more) {
+            inflight--;
+        }
+        UringOp op = UringOp(e.user_data >> 32);
+        int fd = int(uint32_t(e.user_data));
+
+        if (op == OpAccept) {
+            if (e.res >= 0) {
+                uringAccept(ring, e.res);
+            }
+            else if (e.res != -ECANCELED) {
+                LOG_ERROR("accept error: %s", strerror(-e.res));
+            }
+            if (!more && !stopped && !draining) {
+                ring.accept(sockfd, tag(OpAccept, sockfd));
+                inflight++;
+            }
+            return;
+        }
+        if (op == OpEvents) {
+            uringEvents();
+            if (!more && !stopped) {
+                ring.poll(epfd, POLLIN, tag(OpEvents, epfd));
+                inflight++;
+            }
+            return;
+        }
+        if (op == OpCancel) {
+            return;
+        }
+
+        auto it = conns.find(fd);
+        if (it == conns.end() || !it->second->uring) {
+            return;
+        }
+        Connection &c = *it->second;
+        UringIo &u = *c.uring;
+        Metrics &m = Metrics::local();
+
+        if (op == OpRecv) {
+            if (e.flags & IORING_CQE_F_BUFFER) {
+                unsigned bid = e.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (e.res > 0 && !u.closing) {
+                    c.framer.append(ring.buffer(bid), e.res);
+                    m.bytesIn.add(e.res);
+                    c.active = timers.now();
+                }
+                ring.recycle(bid);
+            }
+            if (!more) {
+                u.receiving = false;
+            }
+            if (!more && !u.closing) {
+                if (e.res > 0 || e.res == -ENOBUFS || ((u.paused || u.handing) && e.res == -ECANCELED)) {
+                    // the multishot recv stopped early, e.g. every buffer was in use, or was cancelled
+                    // by a pause, a paused connection gets it back from uringResume(), one being
+                    // handed over only if a partial message arrived meanwhile
+                    u.paused = c.paused;
+                    u.handing = u.handing && e.res == -ECANCELED && c.framer.pending() == 0;
+                    if (!c.paused && !u.handing) {
+                        ring.recv(fd, tag(OpRecv, fd));
+                        u.receiving = true;
+                        inflight++;
+                    }
+                }
+                else if (e.res == 0) {
+                    c.closing = true;
+                }
+                else {
+                    // reset by the peer, nobody left to reply to
+                    c.failed = true;
+                }
+            }
+            if (e.res > 0 && !u.closing) {
+                dispatch(c);
+            }
+            if (c.paused && !u.paused && !u.closing) {
+                // stop receiving until the replies drain, what is already in flight still lands
+                u.paused = true;
+                if (u.receiving) {
+                    ring.cancelRequest(tag(OpRecv, fd), tag(OpCancel, fd));
+                    inflight++;
+                }
+            }
+        }
+        else if (op == OpSend) {
+            u.sending = false;
+            if (e.res >= 0) {
+                c.out.consume(e.res);
+                c.flush();
+                if (!u.closing) {
+                    uringResume(ring, c);
+                }
+                arm(c, false);
+            }
+            else if (e.res != -ECANCELED) {
+                m.errors.add();
+                LOG_WARN("Connection write error: %s", strerror(-e.res));
+                c.failed = c.closing = true;
+            }
+        }
+
+        if (u.closing) {
+            if (!u.receiving && !u.sending) {
+                released.push_back(fd);
+            }
+        }
+        else if (c.done()) {
+            uringClose(ring, c);
+        }
+    }
+
+    // submit the output queues written during this batch, then let go of closed connections
+    void uringFlush(Uring &ring)
+    {
+        for (Connection *c : sendQueue) {
+            c->uring->queued = false;
+            if (!c->uring->closing && !c->uring->sending && !c->out.empty()) {
+                uringSend(ring, *c);
+            }
+        }
+        sendQueue.clear();
+        for (int fd : released) {
+            Connection &c = *conns[fd];
+            unsettle(c);
+            if (c.uring->handing) {
+                keep(HandedConnection{fd, c.framer.framing(), c.framer.newlines(), c.encoding, c.received > 0});
+                c.fd = -1;
+            }
+            Metrics::local().closed.add();
+            conns.erase(fd);
+        }
+        released.clear();
+    }
+
+    // the io_uring event loop, false if the kernel does not support it, nothing was served then
+    //
+    // accept and recv are multishot, one request each keeps delivering completions, received
+    // bytes land in buffers the kernel picks from a provided buffer ring, the replies of a whole
+    // batch of completions go out with the next io_uring_enter() together with the wait
+    // for more, one syscall per batch instead of one per accept, read and write
+    bool runUring()
+    {
+        Uring ring;
+        if (!ring.open()) {
+            LOG_WARN("io_uring is not available (%s), using epoll", strerror(errno));
+            return false;
+        }
+
+        // the listening socket is served by the ring, the epoll instance keeps the wakeup
+        // eventfd and the shm endpoint and the ring polls it for them
+        epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
+        ring.accept(sockfd, tag(OpAccept, sockfd));
+        ring.poll(epfd, POLLIN, tag(OpEvents, epfd));
+        inflight = 2;
+        takeHanded(-1, [this, &ring](Connection &c) {
+            c.uring = make_unique<UringIo>(&sendQueue);
+            c.uring->receiving = true;
+            ring.recv(c.fd, tag(OpRecv, c.fd));
+            inflight++;
+        });
+
+        io_uring_cqe e;
+        while (!stopped)
+        {
+            if (ring.submit(1, waitTimeout()) < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+                throw SocketError();
+            }
+            reap([this, &ring](Connection &c) { uringClose(ring, c); });
+            while (ring.next(e)) {
+                ring.advance();
+                uringComplete(ring, e);
+            }
+            auto next = [this, &ring](Connection &c) {
+                if (c.shm) {
+                    // served through the epoll instance
+                    resume(c);
+                    if (c.done()) {
+                        closeConnection(c.fd);
+                    }
+                    return;
+                }
+                if (c.uring->closing) {
+                    return;
+                }
+                uringResume(ring, c);
+                arm(c, false);
+                if (c.done()) {
+                    uringClose(ring, c);
+                }
+            };
+            complete(next);
+            wakeStreams(next);
+            subs->tick();
+            armUpdated();
+            Arena::local().reset();
+            if (draining) {
+                drainConnections([this, &ring] {
+                    ring.cancelRequest(tag(OpAccept, sockfd), tag(OpCancel, sockfd));
+                    inflight++;
+                    if (shmfd >= 0) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, shmfd, NULL);
+                    }
+                }, [this, &ring](Connection &c, bool quiet) {
+                    if (!c.uring) {
+                        closeConnection(c.fd);
+                    }
+                    else if (quiet && keep && handable(c)) {
+                        uringHandOver(ring, c);
+                    }
+                    else {
+                        uringClose(ring, c);
+                    }
+                });
+            }
+            uringFlush(ring);
+            if (drainUntil && conns.empty()) {
+                stopped = true;
+            }
+        }
+
+        // cancel everything and let the ring settle before its buffers and the connections go
+        ring.cancel(-1, tag(OpCancel, -1));
+        inflight++;
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(1);
+        while (inflight > 0 && chrono::steady_clock::now() < deadline) {
+            ring.submit(1, 100);
+            while (ring.next(e)) {
+                ring.advance();
+                if (!(e.flags & IORING_CQE_F_MORE)) {
+                    inflight--;
+                }
+                if (e.flags & IORING_CQE_F_BUFFER) {
+                    ring.recycle(e.flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+            }
+        }
+        sendQueue.clear();
+        released.clear();
+        return true;
+    }
+#else
+    bool runUring()
+    {
+        LOG_WARN("io_uring support is not compiled in, using epoll");
+        return false;
+    }
+#endif
+
+    // hand a new shared memory channel to every client of the shm endpoint, the unix socket
+    // stays open only to tell when the client goes away
+    void acceptShm()
+    {
+        for (;;)
+        {
+            sockaddr_storage addr{};
+            socklen_t len = sizeof(addr);
+            int fd = accept4(shmfd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+            try
+            {
+                ucred cred;
+                if (!peerCredentials(fd, cred) || (peerCheck && !peerCheck(cred))) {
+                    throw SocketError("shm peer rejected by the peer check");
+                }
+                auto ch = make_unique<ShmChannel>(shmCapacity);
+                // the first request must wake the server, set before the client can send one
+                ch->requests.sleep();
+                int fds[4] = {ch->memfd, ch->serverWake, ch->clientWake, ch->roomWake};
+                if (!sendFds(fd, fds, 4, &ch->capacity, sizeof(ch->capacity))) {
+                    throw SocketError();
+                }
+                int wake = ch->serverWake;
+                auto c = make_unique<Connection>(fd, epfd, addr, Framing::Raw);
+                c->cred = cred;
+                c->shm = move(ch);
+                c->subs = subs.get();
+                c->completions = completions.get();
+                c->id = ++connSerial;
+                conns[fd] = move(c);
+                epoll_ctl_add(epfd, fd, EPOLLIN | EPOLLET | EPOLLRDHUP);
+                Metrics::local().accepted.add();
+                epoll_ctl_add(epfd, wake, EPOLLIN);
+                shmWake[wake] = fd;
+            }
+            catch (SocketError& e)
+            {
+                LOG_ERROR("shm accept error: %s", e.what());
+                close(fd);
+            }
+        }
+    }
+
+    // serve the request ring of a shm client, a bounded batch per wakeup so sockets are not starved
+    // like a socket client it is not read while it is over its limits, its requests stay in the
+    // ring until the client takes its replies and wakes the server, or a completion resumes it
+    void readShm(Connection &c)
+    {
+        ShmChannel &ch = *c.shm;
+        drainFd(ch.serverWake);
+        ch.flush();
+        if (c.paused && !settle(c)) {
+            return;
+        }
+        c.paused = false;
+        c.admit = admission();
+        try
+        {
+            string_view msg;
+            for (int budget = 1024;;) {
+                c.paused = overLimits(c);
+                while (budget > 0 && !c.paused && ch.requests.peek(msg)) {
+                    c.limits = {};
+                    handler(c, msg);
+                    ch.requests.pop();
+                    if (ch.requests.unblock()) {
+                        signalFd(ch.roomWake);
+                    }
+                    budget--;
+                    c.inflight++;
+                    c.paused = overLimits(c);
+                }
+                if (c.paused) {
+                    if (settle(c)) {
+                        // every reply is in the ring already
+                        continue;
+                    }
+                    break;
+                }
+                if (budget == 0) {
+                    signalFd(ch.serverWake); // more to do, come back after the other events
+                    break;
+                }
+                if (ch.requests.sleep()) {
+                    break;
+                }
+            }
+        }
+        catch (SocketError& e)
+        {
+            Metrics::local().errors.add();
+            LOG_ERROR("request handler error: %s", e.what());
+            c.closing = true;
+        }
+        settle(c);
+    }
+
+    // next message of the read() client, a reply that went out before its framing was known
+    // gets the newline that ends its line first
+    bool next(string_view &msg)
+    {
+        bool got = framer.next(msg);
+        if (framer.closeLine()) {
+            sendAll(newsockfd, "\n");
+        }
+        return got;
+    }
+
     public:
         // use with createServer() method
         Server(){}
         // immediately initialize the server socket with the port provided
         Server(const uint16_t &port, const string ip = "127.0.0.1" ): PORT{port}, IP{ip} { initSocket(port, ip); }
-        virtual ~Server() {} // use for polymorphism or class derivation // ok w/ or w/o
+        virtual ~Server() // use for polymorphism or class derivation // ok w/ or w/o
+        {
+            for (auto &p : {unixPath, shmPath}) {
+                if (!p.empty()) {
+                    unlink(p.c_str());
+                }
+            }
+        }
         //~Server() {} // basic 
 
-        void createServer(const uint16_t &Port, const string Ip = "127.0.0.1")
+        // returns 0 on success, 1 if the socket could not be initialized
+        int createServer(const uint16_t &Port, const string Ip = "127.0.0.1")
         {
-            initSocket(Port, Ip);
+            return initSocket(Port, Ip);
+        }
+
+        // serve a listening socket inherited from systemd or handed over by the previous instance,
+        // see listenFds() and HandOff, returns 0 on success, 1 if fd is not a listening socket
+        int adoptServer(int fd)
+        {
+            try
+            {
+                sockaddr_storage addr{};
+                socklen_t len = sizeof(addr);
+                int listening = 0;
+                socklen_t olen = sizeof(listening);
+                if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0 ||
+                    getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &olen) < 0) {
+                    throw SocketError();
+                }
+                if (!listening) {
+                    throw SocketError("Not a listening socket");
+                }
+                family = addr.ss_family;
+                if (family == AF_INET) {
+                    auto &in = reinterpret_cast<sockaddr_in&>(addr);
+                    char buf[INET_ADDRSTRLEN];
+                    inet_ntop(AF_INET, &in.sin_addr, buf, sizeof(buf));
+                    IP = ip = buf;
+                    PORT = port = ntohs(in.sin_port);
+                }
+                else if (family == AF_UNIX) {
+                    // the socket file belongs to whoever made it, it is not removed
+                    auto &un = reinterpret_cast<sockaddr_un&>(addr);
+                    IP = ip = un.sun_path[0] ? string(un.sun_path) : "@" + string(un.sun_path + 1, len - offsetof(sockaddr_un, sun_path) - 1);
+                    PORT = port = 0;
+                }
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                sockfd = fd;
+                initListener();
+                return 0;
+            }
+            catch (SocketError& e)
+            {
+                LOG_ERROR("socket adopt error: %s", e.what());
+                return 1;
+            }
+        }
+
+        // unix domain stream server for same-host clients, path is a socket file or "@name" for
+        // the abstract namespace, returns 0 on success, 1 if the socket could not be initialized
+        int createUnixServer(const string &path)
+        {
+            return initUnixSocket(path);
+        }
+
+        // shared memory endpoint for co-located C++ clients (ShmClient), served by run() through the
+        // same request handler as the sockets, each client gets its own pair of rings of capacity bytes
+        // use after createServer() or createUnixServer(), returns 0 on success
+        int listenShm(const string &path, uint64_t capacity = SHM_RING_SIZE)
+        {
+            try
+            {
+                if (epfd < 0) {
+                    throw SocketError("No event loop!\n Did you forget to call the createServer() method!");
+                }
+                sockaddr_un addr;
+                socklen_t len = unixAddress(path, addr);
+                shmfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (shmfd < 0) {
+                    throw SocketError();
+                }
+                if (path[0] != '@') {
+                    unlink(path.c_str());
+                }
+                if (bind(shmfd, (struct sockaddr *)&addr, len) < 0 || listen(shmfd, MAX_CONN) < 0) {
+                    throw SocketError();
+                }
+                if (path[0] != '@') {
+                    shmPath = path;
+                }
+                shmCapacity = capacity;
+                epoll_ctl_add(epfd, shmfd, EPOLLIN);
+                return 0;
+            }
+            catch (SocketError& e)
+            {
+                LOG_ERROR("shm initialize error: %s", e.what());
+                if (shmfd >= 0) {
+                    close(shmfd);
+                    shmfd = -1;
+                }
+                return 1;
+            }
+        }
+
+        // accept a unix domain client only if check returns true for its pid, uid and gid
+        // use before accepting clients, e.g. setPeerCheck([](const ucred &c){ return c.uid == getuid(); })
+        void setPeerCheck(function<bool(const ucred&)> check)
+        {
+            peerCheck = move(check);
+        }
+
+        // let several Server instances bind the same port, the kernel spreads new connections across them
+        // use before calling the createServer() method
+        void reusePort(bool on = true)
+        {
+            reuseport = on;
         }
 
         // server address property
@@ -129,17 +1471,19 @@ class Server
             ServerLoop = serverloop;
             try
             {
-                // using anonymous lambda function for async pattern
-                auto l = [] (int fd, sockaddr_in client_addr, socklen_t clen)
-                //auto l = [] (auto fd, auto client_addr, auto clen) // using auto in args requires -std=c++20 or -fconcepts flag during compilation 
-                {
-                  auto newfd = accept4(fd, (struct sockaddr *) &client_addr, &clen, SOCK_NONBLOCK);
-                  
-                  if (newfd < 0){ throw SocketError("Invalid socket descriptor! Listen flag is false! \nMaybe you want to set it to true like Listen(true).");}
-                  return newfd;
-                };
+                // accept in place, an async() round trip only added a thread and its shared state
+                newsockfd = accept4(sockfd, (struct sockaddr *) &client_addr, &clen, SOCK_NONBLOCK);
+                if (newsockfd < 0) {
+                    throw SocketError("Invalid socket descriptor! Listen flag is false! \nMaybe you want to set it to true like Listen(true).");
+                }
+                framer = Framer(framing);
 
-                newsockfd = async(l, sockfd, client_addr, clen).get();
+                ucred cred;
+                if (!acceptPeer(newsockfd, cred)) {
+                    close(newsockfd);
+                    newsockfd = -1;
+                    throw SocketError("unix peer rejected by the peer check");
+                }
 
                 if (!listenF){
                   //cout << "Server listening on: " << IP << ":" << PORT << "\n\n";
@@ -151,7 +1495,7 @@ class Server
             }
             catch (SocketError& e)
             {
-                cerr << "listen error: " << e.what() << endl;
+                LOG_ERROR("listen error: %s", e.what());
                 closeHandler();
             }
         }
@@ -161,129 +1505,106 @@ class Server
             clientListen(serverloop);
         }
 
+        // wait for the next complete message, same as read()
         virtual const string readSync()
         {
-            char buffer[BUF_SIZE];
-
-            if(!listenF){
-                throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
-            }
-
-            try
-            {
-                //nfd = epoll_wait(epfd, events, MAX_EVENTS, -1); // blocks next execution if no available data  
-                nfd = epoll_wait(epfd, events, MAX_EVENTS, 1000); // wait 1 sec for next execution
-
-                for (i = 0; i < nfd; i++) {
-                    if (events[i].data.fd == newsockfd) {
-                        if (events[i].events & EPOLLIN) {
-                            ssize_t n = 1;
-                            bzero(buffer, sizeof(buffer));
-                            n = {recv(events[i].data.fd, buffer, sizeof(buffer), 0)}; 
-                            //cout << "server read sync n = " << n << endl;
-                            if (n <= 0 || errno == EAGAIN ) {
-                                //cout << "no available data, read again\n" << endl;
-                                break;
-                            }
-                            if (n == 0){
-                                cout << "readSync error, socket is closed or disconnected\n";
-                            }
-                         }
-                         else {
-                            cout << "unexpected readSync error\n";
-                         }
-                         // check if the connection is closed
-                         if (events[i].events & (EPOLLRDHUP | EPOLLHUP)) {
-                            cout << "readSync error, connection is closed!\n";
-                            epoll_ctl(epfd, EPOLL_CTL_DEL,
-                            events[i].data.fd, NULL);
-                            close(events[i].data.fd);
-                            continue;
-                         }
-                    }
-                }
-                if(nfd < 1){
-                    cout << "readSync error: no available data\n" << endl;
-                    bzero(buffer, sizeof(buffer));
-                }
-            }
-            catch (SocketError& e)
-            {
-                cerr << "readSync error: " << e.what() << endl;
-                closeHandler();
-            }
-            return buffer;
+            return read();
         }
 
-        // read data asynchronously, use only after calling the Listen() method
-        virtual const string read(const int bufsize=1024) 
+        // wait up to timeout ms for the next complete message, use only after calling the Listen() method
+        // a timeout of -1 uses the setReadTimeout() value, returns an empty string if no message arrived
+        virtual const string read(const int bufsize=1024, const int timeout=-1) 
         {
             if(!listenF){
                 throw SocketError("No listening socket!\n Did you forget to start the Listen() method!");
             }
 
             string ad;
+            string_view msg;
+
+            // a message pipelined behind the previous one is already buffered
+            if (next(msg)) {
+                return string(msg);
+            }
           
             try
             {
-                auto l = [bufsize] (const int fd)
+                int ms = timeout < 0 ? readTimeout : timeout;
+                auto deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+
+                for (;;)
                 {
-                    string s;
-                    int x = 0;
-                    ssize_t n = 1;
-                    char buffer[BUF_SIZE];
-
-                    if(bufsize){
-                        *buffer = buffer[bufsize];
-                    } 
-
-                    bzero(buffer, sizeof(buffer));
-                    while (( n = {recv(fd, buffer, sizeof(buffer), 0)} ) < 0) {  
-                        bzero(buffer, sizeof(buffer));
-                        if(x == 100000){ break; }
-                        x++;
+                    int wait = -1;
+                    if (ms >= 0) {
+                        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                        wait = left > 0 ? left : 0;
                     }
-                    //cout << "server read async n = " << n << " bytes, x = " << x << endl;
-                    if (n <= 0 || errno == EAGAIN ){
-                        cout << "read error: no available data\n" << endl;
+
+                    nfd = epoll_wait(epfd, events, MAX_EVENTS, wait);
+                    if (nfd < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        throw SocketError();
                     }
-                    if (n == 0){
-                        cout << "read error, socket is closed or disconnected\n";
+                    if (nfd == 0) {
+                        Metrics::local().timeouts.add();
+                        LOG_WARN("read error: no available data");
+                        break;
                     }
-                    s = &buffer[0];  
-                    return s; 
-                };
-
-                //nfd = epoll_wait(epfd, events, MAX_EVENTS, -1); // blocks next execution if no available data  
-                nfd = epoll_wait(epfd, events, MAX_EVENTS, 1000); // wait 1 sec for next execution
-                for (i = 0; i < nfd; i++) {
-                    if (events[i].data.fd == newsockfd) {
-                        if (events[i].events & EPOLLIN) {
-                            ad = async(l, newsockfd).get();
+
+                    bool closed = false;
+                    for (i = 0; i < nfd; i++) {
+                        if (events[i].data.fd != newsockfd) {
+                            continue;
                         }
-                        else {
-                            cout << "read unexpected error\n";
+                        if (events[i].events & EPOLLIN) {
+                            closed = framer.fill(newsockfd) <= 0;
                         }
                         // check if the connection is closed
-                        if (events[i].events & (EPOLLRDHUP | EPOLLHUP)) {
-                            cout << "read error, connection is closed!\n";
-                            epoll_ctl(epfd, EPOLL_CTL_DEL,
-                            events[i].data.fd, NULL);
-                            close(events[i].data.fd);
-                            continue;
-                        }
+                        closed = closed || (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+                    }
+
+                    if (next(msg)) {
+                        ad = msg;
+                        break;
+                    }
+                    if (closed) {
+                        LOG_WARN("read error, connection is closed!");
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, newsockfd, NULL);
+                        close(newsockfd);
+                        break;
                     }
                 }
-                if(nfd < 1){ 
-                    cout << "read error: no available data\n" << endl;
-                } 
-          }
-          catch (SocketError& e)
-          {
-                cerr << "read error: " << e.what() << endl;
+            }
+            catch (SocketError& e)
+            {
+                LOG_ERROR("read error: %s", e.what());
                 closeHandler();
-          }
-          return ad;
+            }
+            return ad;
+        }
+
+        // default read() timeout in ms, -1 waits until a message arrives
+        void setReadTimeout(int ms)
+        {
+            readTimeout = ms;
+        }
+
+        // reactor mode: connection, request and output limits, see Limits
+        void setLimits(const Limits &l)
+        {
+            limits = l;
+            if (sockfd >= 0) {
+                listen(sockfd, limits.backlog);
+            }
+        }
+
+        // reactor mode: idle, read, write and handler deadlines of the connections, see Timeouts
+        // the loop sleeps until the next one is due, use before calling the run() method
+        void setTimeouts(const Timeouts &t)
+        {
+            timeouts = t;
         }
 
         virtual const string sendSync(const string &msg) const
@@ -294,14 +1615,13 @@ class Server
 
             try
             {
-                ssize_t n{send(newsockfd, msg.c_str(), strlen(msg.c_str()), 0)};
-                if (n < 0) {
+                if (sendAll(newsockfd, msg) < msg.size()) {
                     throw SocketError();
                 }
             }
             catch (SocketError& e)
             {
-                cerr << "sendSync error: " << e.what() << endl;
+                LOG_ERROR("sendSync error: %s", e.what());
                 closeHandler();
             }
             return msg;
@@ -315,25 +1635,115 @@ class Server
 
             try
             {
-                // using lambda expressions
-                auto l = [] (const int fd, const string &msg)
-                {
-            	    ssize_t n{send(fd, msg.c_str(), strlen(msg.c_str()), 0)};
-                    //cerr << "write n: " << n << endl;
-            	    if (n < 0) {
-              	        throw SocketError();
-            	    }
-                };
-                async(l, newsockfd, msg).get();
+                // send inline, a short write waits for the socket to drain instead of truncating the reply
+                char h[4];
+                string out(h, framer.header(msg.size(), h));
+                out.append(msg);
+                out.append(framer.trailer());
+                if (sendAll(newsockfd, out) < out.size()) {
+                    throw SocketError();
+                }
             }
             catch (SocketError& e)
             {
-                cerr << "Server write error: " << e.what() << endl;
+                LOG_ERROR("Server write error: %s", e.what());
                 closeHandler();
             }
             return msg;
         }
 
+        // how messages are delimited on the wire, Auto detects it per connection
+        // use before accepting clients
+        void setFraming(Framing f)
+        {
+            framing = f;
+            framer.setFraming(f);
+        }
+
+        // reactor mode: serve the clients through io_uring instead of epoll, multishot accept and recv
+        // and batched sends, run() falls back to epoll if the kernel does not support it
+        // use before calling the run() method
+        void useUring(bool on = true)
+        {
+            uringWanted = on;
+        }
+
+        // the listening socket, to hand over to the next instance once run() returned
+        int listener()
+        {
+            // the next instance serves the socket file from now on
+            unixPath.clear();
+            return sockfd;
+        }
+
+        // reactor mode: serve a client connection handed over by the previous instance, it joins
+        // when run() starts, use before calling the run() method
+        void adopt(const HandedConnection &h)
+        {
+            handed.push_back(h);
+        }
+
+        // reactor mode: hand over to the next instance, stop accepting and let the connections go
+        // as soon as they have no request in flight, those the next instance can go on with to
+        // keep, the others are closed, run() returns once all are gone or after ms
+        // safe to call once from another thread
+        void drain(function<void(const HandedConnection&)> k = nullptr, int ms = HANDOFF_DRAIN)
+        {
+            keep = move(k);
+            drainMs = ms;
+            // the loop sees keep once it sees draining
+            draining = true;
+            if (wakefd >= 0) {
+                uint64_t one = 1;
+                ::write(wakefd, &one, sizeof(one));
+            }
+        }
+
+        // reactor mode: set the callback that receives every request from every connection
+        void onRequest(RequestHandler h)
+        {
+            handler = move(h);
+        }
+
+        // reactor mode: run every connection as a coroutine instead, it takes the requests with
+        // co_await readMessage() and may write and sleep in between, see Stream, shm clients
+        // still go to the onRequest() handler
+        void onConnection(StreamHandler h)
+        {
+            streamHandler = move(h);
+        }
+
+        // reactor mode: serve all clients on persistent connections until stop() is called
+        void run()
+        {
+            if (sockfd < 0) {
+                throw SocketError("No listening socket!\n Did you forget to call the createServer() method!");
+            }
+            if (!handler && (!streamHandler || shmfd >= 0)) {
+                throw SocketError("No request handler!\n Did you forget to call the onRequest() method!");
+            }
+
+            setnonblocking(sockfd);
+
+            if (!uringWanted || !runUring()) {
+                runEpoll();
+            }
+
+            while (!conns.empty()) {
+                closeConnection(conns.begin()->first);
+            }
+        }
+
+        // stop the run() loop, safe to call from another thread or a signal handler
+        void stop()
+        {
+            stopped = true;
+            if (wakefd >= 0) {
+                uint64_t one = 1;
+                ::write(wakefd, &one, sizeof(one));
+            }
+        }
+
         virtual void end() const
         {
             if(ServerLoop){
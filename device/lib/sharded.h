@@ -0,0 +1,215 @@
+/*
+ * Source File: sharded.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include "server.h"
+
+namespace Tcp {
+
+using namespace std;
+
+struct ShardOptions
+{
+    unsigned workers = 0;   // number of event loop threads, 0 uses one per available core
+    bool pinCpu = false;    // pin worker n to cpu (firstCpu + n) % ncpu
+    unsigned firstCpu = 0;
+    bool uring = false;     // serve through io_uring where the kernel supports it, see Server::useUring()
+};
+
+// runs one reactor Server per worker thread, each with its own SO_REUSEPORT listening socket,
+// epoll instance and connection table, the workers share nothing while serving requests
+class ShardedServer
+{
+    ShardOptions opt;
+    vector<unique_ptr<Server>> shards;
+    vector<thread> threads;
+    size_t sockets = 0;     // shards with a listening socket of their own, the rest share one
+
+    void pin(thread &t, unsigned n)
+    {
+        unsigned ncpu = thread::hardware_concurrency();
+        if (ncpu == 0) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((opt.firstCpu + n) % ncpu, &set);
+        if (int rc = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set); rc != 0) {
+            LOG_WARN("worker %u cpu pinning error: %s", n, strerror(rc));
+        }
+    }
+
+    public:
+        ShardedServer(const uint16_t &Port, const string Ip = "127.0.0.1", ShardOptions o = {}) : opt{o}, ip{Ip}, port{Port}
+        {
+            if (opt.workers == 0) {
+                opt.workers = max(1u, thread::hardware_concurrency());
+            }
+
+            // bind every shard up front so a port error is reported before any worker starts
+            for (unsigned n = 0; n < opt.workers; n++) {
+                auto s = make_unique<Server>();
+                s->reusePort();
+                s->useUring(opt.uring);
+                if (s->createServer(Port, Ip) != 0) {
+                    throw SocketError("Unable to create a server shard");
+                }
+                shards.push_back(move(s));
+            }
+            sockets = shards.size();
+        }
+
+        // serve listening sockets inherited from systemd or handed over by the previous instance,
+        // see listenFds() and HandOff, every socket gets a worker, with more workers than sockets
+        // they share them
+        ShardedServer(const vector<int> &listeners, ShardOptions o = {}) : opt{o}, port{0}
+        {
+            if (listeners.empty()) {
+                throw SocketError("No listening socket to adopt");
+            }
+            if (opt.workers == 0) {
+                opt.workers = max(1u, thread::hardware_concurrency());
+            }
+            // a reuseport group hands connections to every socket in it, none may go unserved
+            opt.workers = max<unsigned>(opt.workers, listeners.size());
+
+            for (unsigned n = 0; n < opt.workers; n++) {
+                auto s = make_unique<Server>();
+                s->useUring(opt.uring);
+                int fd = n < listeners.size() ? listeners[n] : dup(listeners[n % listeners.size()]);
+                if (s->adoptServer(fd) != 0) {
+                    throw SocketError("Unable to create a server shard");
+                }
+                shards.push_back(move(s));
+            }
+            sockets = listeners.size();
+            ip = shards[0]->ip;
+            port = shards[0]->port;
+        }
+        ~ShardedServer()
+        {
+            stop();
+            join();
+        }
+
+        // server address property
+        string ip;
+        uint16_t port;
+
+        unsigned workers() const
+        {
+            return opt.workers;
+        }
+
+        // each shard gets its own copy of the handler, any state it captures by reference is shared
+        void onRequest(RequestHandler h)
+        {
+            for (auto &s : shards) {
+                s->onRequest(h);
+            }
+        }
+
+        // every shard runs its connections as coroutines of h
+        void onConnection(StreamHandler h)
+        {
+            for (auto &s : shards) {
+                s->onConnection(h);
+            }
+        }
+
+        void setFraming(Framing f)
+        {
+            for (auto &s : shards) {
+                s->setFraming(f);
+            }
+        }
+
+        void setTimeouts(const Timeouts &t)
+        {
+            for (auto &s : shards) {
+                s->setTimeouts(t);
+            }
+        }
+
+        // the limits hold for each shard on its own
+        void setLimits(const Limits &l)
+        {
+            for (auto &s : shards) {
+                s->setLimits(l);
+            }
+        }
+
+        // serve the connections handed over by the previous instance, spread over the workers
+        void adopt(const vector<HandedConnection> &conns)
+        {
+            for (size_t k = 0; k < conns.size(); k++) {
+                shards[k % shards.size()]->adopt(conns[k]);
+            }
+        }
+
+        // hand over to the next instance, see Server::drain(), keep is called from every worker
+        void drain(function<void(const HandedConnection&)> keep = nullptr, int ms = HANDOFF_DRAIN)
+        {
+            for (auto &s : shards) {
+                s->drain(keep, ms);
+            }
+        }
+
+        // the listening sockets, one each, for the next instance, see HandOff
+        vector<int> listeners()
+        {
+            vector<int> fds;
+            for (size_t n = 0; n < sockets; n++) {
+                fds.push_back(shards[n]->listener());
+            }
+            return fds;
+        }
+
+        // start the worker threads and block until all of them have stopped
+        void run()
+        {
+            for (unsigned n = 0; n < shards.size(); n++) {
+                threads.emplace_back([this, n] {
+                    try
+                    {
+                        shards[n]->run();
+                    }
+                    catch (SocketError& e)
+                    {
+                        LOG_ERROR("worker %u error: %s", n, e.what());
+                    }
+                });
+                if (opt.pinCpu) {
+                    pin(threads.back(), n);
+                }
+            }
+            join();
+        }
+
+        void stop()
+        {
+            for (auto &s : shards) {
+                s->stop();
+            }
+        }
+
+        void join()
+        {
+            for (auto &t : threads) {
+                if (t.joinable()) {
+                    t.join();
+                }
+            }
+            threads.clear();
+        }
+};
+
+}
+
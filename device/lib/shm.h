@@ -0,0 +1,398 @@
+/*
+ * Source File: shm.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "socketerror.h"
+#include "log.h"
+#include "unixsocket.h"
+
+#define SHM_RING_SIZE   (1024 * 1024)
+#define SHM_SPIN        2000    // reply polls before a ShmClient sleeps on its eventfd
+
+namespace Tcp {
+
+using namespace std;
+
+// control block at the start of every ring, head and tail on their own cache lines
+struct ShmRingHeader
+{
+    alignas(64) atomic<uint64_t> head;      // consumer position
+    alignas(64) atomic<uint64_t> tail;      // producer position
+    alignas(64) atomic<uint32_t> sleeping;  // consumer waits on its eventfd, producer must signal
+    atomic<uint32_t> blocked;               // producer found the ring full, consumer must signal
+};
+
+// lock-free single producer single consumer ring of length-prefixed messages in shared memory
+class SpscRing
+{
+    static constexpr uint32_t WRAP = 0xffffffff;
+
+    ShmRingHeader *h = nullptr;
+    char *data = nullptr;
+    uint64_t size = 0;
+    uint64_t next = 0;  // head after the message returned by peek()
+
+    static uint64_t align(uint64_t n)
+    {
+        return (n + 7) & ~uint64_t(7);
+    }
+
+    public:
+        SpscRing() {}
+        SpscRing(void *base, uint64_t capacity) : h{static_cast<ShmRingHeader *>(base)}, data{static_cast<char *>(base) + sizeof(ShmRingHeader)}, size{capacity} {}
+
+        // bytes a ring of capacity takes in the shared region
+        static uint64_t footprint(uint64_t capacity)
+        {
+            return sizeof(ShmRingHeader) + capacity;
+        }
+
+        uint64_t maxMessage() const
+        {
+            return size / 2 - 8;
+        }
+
+        bool empty() const
+        {
+            return h->head.load(memory_order_relaxed) == h->tail.load(memory_order_acquire);
+        }
+
+        // producer side, false if the ring has no room for msg right now
+        bool push(string_view msg)
+        {
+            uint64_t tail = h->tail.load(memory_order_relaxed);
+            uint64_t head = h->head.load(memory_order_acquire);
+            uint64_t need = align(4 + msg.size());
+            uint64_t pos = tail & (size - 1);
+            uint64_t room = size - pos;
+            uint64_t skip = need > room ? room : 0;     // message does not fit before the end, wrap
+
+            if (msg.size() > maxMessage() || size - (tail - head) < skip + need) {
+                return false;
+            }
+            if (skip) {
+                memcpy(data + pos, &WRAP, 4);
+                pos = 0;
+            }
+            uint32_t len = msg.size();
+            memcpy(data + pos, &len, 4);
+            memcpy(data + pos + 4, msg.data(), msg.size());
+            h->tail.store(tail + skip + need, memory_order_release);
+            return true;
+        }
+
+        // consumer side, view of the oldest message without removing it
+        bool peek(string_view &msg)
+        {
+            uint64_t head = h->head.load(memory_order_relaxed);
+            if (head == h->tail.load(memory_order_acquire)) {
+                return false;
+            }
+            uint64_t pos = head & (size - 1);
+            uint32_t len;
+            memcpy(&len, data + pos, 4);
+            if (len == WRAP) {
+                head += size - pos;
+                pos = 0;
+                memcpy(&len, data, 4);
+            }
+            msg = string_view(data + pos + 4, len);
+            next = head + align(4 + len);
+            return true;
+        }
+
+        // release the message returned by peek()
+        void pop()
+        {
+            h->head.store(next, memory_order_release);
+        }
+
+        // consumer is about to sleep, false if a message arrived meanwhile and it must not
+        bool sleep()
+        {
+            h->sleeping.store(1, memory_order_seq_cst);
+            if (!empty()) {
+                h->sleeping.store(0, memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        // producer after push(), true if the consumer sleeps and needs its eventfd signalled
+        bool wake()
+        {
+            atomic_thread_fence(memory_order_seq_cst);
+            return h->sleeping.load(memory_order_relaxed) && h->sleeping.exchange(0);
+        }
+
+        // producer found the ring full, the consumer signals once it made room
+        // the producer must retry its push after this to close the race with the consumer
+        void block()
+        {
+            h->blocked.store(1, memory_order_seq_cst);
+        }
+
+        // consumer after pop(), true if the producer waits for room and needs its eventfd signalled
+        bool unblock()
+        {
+            atomic_thread_fence(memory_order_seq_cst);
+            return h->blocked.load(memory_order_relaxed) && h->blocked.exchange(0);
+        }
+};
+
+inline void signalFd(int fd)
+{
+    uint64_t one = 1;
+    ::write(fd, &one, sizeof(one));
+}
+
+inline void drainFd(int fd)
+{
+    uint64_t v;
+    while (::read(fd, &v, sizeof(v)) > 0) {}
+}
+
+// the shared region of one local client, a request ring (client to server) and a reply ring
+// (server to client) in a memfd, plus one eventfd per side for wakeups and one the client
+// waits on for room in the request ring, so a writer thread does not take a reader's wakeup
+//
+// the server creates it and hands memfd and eventfds to the client over a unix domain socket
+class ShmChannel
+{
+    void *base = MAP_FAILED;
+    size_t bytes = 0;
+    deque<string> pending;  // replies waiting for room in the reply ring
+    size_t pendingBytes = 0;
+
+    void map(uint64_t capacity)
+    {
+        bytes = 2 * SpscRing::footprint(capacity);
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (base == MAP_FAILED) {
+            throw SocketError();
+        }
+        requests = SpscRing(base, capacity);
+        replies = SpscRing(static_cast<char *>(base) + SpscRing::footprint(capacity), capacity);
+    }
+
+    public:
+        // server side, capacity of each ring is rounded up to a power of two
+        explicit ShmChannel(uint64_t capacity = SHM_RING_SIZE)
+        {
+            uint64_t cap = 4096;
+            while (cap < capacity) {
+                cap <<= 1;
+            }
+            memfd = memfd_create("edge-shm", MFD_CLOEXEC);
+            serverWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            clientWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            roomWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (memfd < 0 || serverWake < 0 || clientWake < 0 || roomWake < 0 || ftruncate(memfd, 2 * SpscRing::footprint(cap)) < 0) {
+                throw SocketError();
+            }
+            map(cap);
+            this->capacity = cap;
+        }
+
+        // client side, adopt the descriptors received from the server
+        ShmChannel(int mem, int swake, int cwake, int rwake, uint64_t cap) : memfd{mem}, serverWake{swake}, clientWake{cwake}, roomWake{rwake}, capacity{cap}
+        {
+            map(cap);
+        }
+
+        ShmChannel(const ShmChannel&) = delete;
+        ShmChannel& operator=(const ShmChannel&) = delete;
+        ~ShmChannel()
+        {
+            if (base != MAP_FAILED) {
+                munmap(base, bytes);
+            }
+            for (int fd : {memfd, serverWake, clientWake, roomWake}) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+
+        int memfd = -1, serverWake = -1, clientWake = -1, roomWake = -1;
+        uint64_t capacity = 0;
+        SpscRing requests, replies;
+
+        // server side, queue a reply and push as much as the reply ring takes
+        void send(string_view msg)
+        {
+            if (pending.empty() && replies.push(msg)) {
+                if (replies.wake()) {
+                    signalFd(clientWake);
+                }
+                return;
+            }
+            pending.emplace_back(msg);
+            pendingBytes += msg.size();
+            flush();
+        }
+
+        // server side, bytes of replies waiting for room in the reply ring
+        size_t backlog() const
+        {
+            return pendingBytes;
+        }
+
+        // server side, push the replies that did not fit, true once all are in the ring
+        bool flush()
+        {
+            bool pushed = false;
+            while (!pending.empty() && replies.push(pending.front())) {
+                pendingBytes -= pending.front().size();
+                pending.pop_front();
+                pushed = true;
+            }
+            if (!pending.empty()) {
+                replies.block();
+                // the client may have made room between the failed push and block()
+                while (!pending.empty() && replies.push(pending.front())) {
+                    pendingBytes -= pending.front().size();
+                    pending.pop_front();
+                    pushed = true;
+                }
+            }
+            if (pushed && replies.wake()) {
+                signalFd(clientWake);
+            }
+            return pending.empty();
+        }
+};
+
+// co-located client of a Server::listenShm() endpoint, same read/write API as Client
+// but messages go through shared memory without a syscall while both sides are busy
+class ShmClient
+{
+    int ctlfd = -1;     // unix socket kept open for the lifetime of the channel
+    unique_ptr<ShmChannel> ch;
+    bool held = false;  // the reply returned by read() still occupies its ring slot
+
+    void release()
+    {
+        if (held) {
+            held = false;
+            ch->replies.pop();
+            if (ch->replies.unblock()) {
+                signalFd(ch->serverWake);
+            }
+        }
+    }
+
+    public:
+        ShmClient() {}
+        ~ShmClient() { end(); }
+
+        // connect to the server's shm endpoint and map the rings, returns 0 on success
+        int connect(const string &path)
+        {
+            try
+            {
+                sockaddr_un addr;
+                socklen_t len = unixAddress(path, addr);
+                ctlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (ctlfd < 0 || ::connect(ctlfd, (struct sockaddr *)&addr, len) < 0) {
+                    throw SocketError();
+                }
+                int fds[4];
+                uint64_t cap = 0;
+                if (recvFds(ctlfd, fds, 4, &cap, sizeof(cap)) != 4) {
+                    throw SocketError("shm handshake failed");
+                }
+                ch = make_unique<ShmChannel>(fds[0], fds[1], fds[2], fds[3], cap);
+                return 0;
+            }
+            catch (SocketError& e)
+            {
+                LOG_ERROR("shm connect error: %s", e.what());
+                end();
+                return 1;
+            }
+        }
+
+        // put msg in the request ring, waiting up to timeout ms for room
+        bool write(string_view msg, int timeout = 1000)
+        {
+            if (!ch) {
+                return false;
+            }
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+            while (!ch->requests.push(msg)) {
+                if (msg.size() > ch->requests.maxMessage() || chrono::steady_clock::now() >= deadline) {
+                    return false;
+                }
+                ch->requests.block();
+                if (ch->requests.push(msg)) {
+                    break;
+                }
+                pollfd p{ch->roomWake, POLLIN, 0};
+                poll(&p, 1, 1);
+                drainFd(ch->roomWake);
+            }
+            if (ch->requests.wake()) {
+                signalFd(ch->serverWake);
+            }
+            return true;
+        }
+
+        // wait up to timeout ms for the next reply, spinning briefly before sleeping on the eventfd
+        // returns an empty view on timeout, the view is valid until the next read()
+        string_view read(int timeout = 2000)
+        {
+            if (!ch) {
+                return {};
+            }
+            release();
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+            string_view msg;
+            for (int spin = 0; !ch->replies.peek(msg); spin++) {
+                if (spin < SHM_SPIN) {
+                    continue;
+                }
+                auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                if (left <= 0) {
+                    return {};
+                }
+                if (ch->replies.sleep()) {
+                    pollfd p{ch->clientWake, POLLIN, 0};
+                    poll(&p, 1, left);
+                    drainFd(ch->clientWake);
+                }
+            }
+            // zero copy, the slot is released by the next read()
+            held = true;
+            return msg;
+        }
+
+        void end()
+        {
+            held = false;
+            ch.reset();
+            if (ctlfd >= 0) {
+                close(ctlfd);
+                ctlfd = -1;
+            }
+        }
+};
+
+}
+
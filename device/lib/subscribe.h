@@ -0,0 +1,277 @@
+/*
+ * Source File: subscribe.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "connection.h"
+#include "request.h"
+#include "topiccache.h"
+
+#define SUB_HIGH_WATER  (64 * 1024)     // queued bytes above which a subscriber only keeps the latest update
+
+namespace Tcp {
+
+using namespace std;
+
+// the topic subscriptions of one Server event loop, only touched on the loop thread except
+// for the dirty flags and the wakeup that TopicCache publishers set
+//
+// {"method":"node-edge-subscribe", "topic":"random-data", "deadband":5, "interval":100}
+// the reply and every update after it is the subscribe request echoed back with the current value,
+// an update is sent when the value changed by at least deadband (numbers) or at all (anything else)
+// and no sooner than interval ms after the previous one, a subscriber that falls behind
+// gets only the newest value once it catches up
+class Subscriptions
+{
+    struct Sub
+    {
+        Connection *c;
+        CachedTopic *topic;
+        string request;         // the subscribe message, updates are replies to it
+        double deadband;
+        int64_t interval;       // ns
+        string last;            // value sent last
+        int64_t lastSent = 0;
+        string pending;         // newest value not sent yet, coalesced
+        bool hasPending = false;
+    };
+
+    struct Watch
+    {
+        CachedTopic *topic;
+        int id;
+        atomic<bool> dirty{false};
+    };
+
+    int wakefd;
+    atomic<bool> signaled{false};
+    vector<unique_ptr<Sub>> subs;
+    vector<unique_ptr<Watch>> watches;
+    size_t pendingCount = 0;
+    string value;   // scratch for CachedTopic::load()
+
+    static int64_t now()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // a number or a json string holding one
+    static bool number(const string &v, double &out)
+    {
+        string_view s = v;
+        if (s.size() >= 2 && s.front() == '"' && s.back() == '"') {
+            s = s.substr(1, s.size() - 2);
+        }
+        if (s.empty() || s.size() > 63) {
+            return false;
+        }
+        char buf[64];
+        memcpy(buf, s.data(), s.size());
+        buf[s.size()] = '\0';
+        char *end;
+        out = strtod(buf, &end);
+        return end == buf + s.size();
+    }
+
+    void send(Sub &s, const string &v)
+    {
+        try
+        {
+            Request req(s.request, s.c->encoding);
+            s.c->write(req.replyJson(v));
+        }
+        catch (json::exception& ex)
+        {
+            LOG_WARN("subscription update error: %s", ex.what());
+        }
+        s.last = v;
+        s.lastSent = now();
+        if (s.hasPending) {
+            s.hasPending = false;
+            pendingCount--;
+        }
+    }
+
+    void offer(Sub &s, const string &v)
+    {
+        double a, b;
+        if (v == s.last || (s.deadband > 0 && number(v, a) && number(s.last, b) && fabs(a - b) < s.deadband)) {
+            // nothing worth telling compared to what the subscriber has, an older pending value is moot
+            if (s.hasPending) {
+                s.hasPending = false;
+                pendingCount--;
+            }
+            return;
+        }
+        if (now() - s.lastSent < s.interval || s.c->output() >= SUB_HIGH_WATER) {
+            if (!s.hasPending) {
+                s.hasPending = true;
+                pendingCount++;
+            }
+            s.pending = v;
+            return;
+        }
+        send(s, v);
+        sent.push_back(s.c);
+    }
+
+    Watch &watch(CachedTopic *t)
+    {
+        for (auto &w : watches) {
+            if (w->topic == t) {
+                return *w;
+            }
+        }
+        auto w = make_unique<Watch>();
+        w->topic = t;
+        Watch *p = w.get();
+        w->id = t->watch([this, p] {
+            p->dirty.store(true, memory_order_release);
+            if (!signaled.exchange(true)) {
+                uint64_t one = 1;
+                ::write(wakefd, &one, sizeof(one));
+            }
+        });
+        watches.push_back(move(w));
+        return *p;
+    }
+
+    void erase(size_t k)
+    {
+        if (subs[k]->hasPending) {
+            pendingCount--;
+        }
+        subs.erase(subs.begin() + k);
+    }
+
+    public:
+        // connections poll() and tick() wrote updates to, the server arms their write deadlines and clears it
+        vector<Connection*> sent;
+
+        // fd is the eventfd of the event loop, written when a watched topic has a new value
+        explicit Subscriptions(int fd) : wakefd{fd} {}
+        Subscriptions(const Subscriptions&) = delete;
+        Subscriptions& operator=(const Subscriptions&) = delete;
+        ~Subscriptions()
+        {
+            for (auto &w : watches) {
+                w->topic->unwatch(w->id);
+            }
+        }
+
+        // subscribe c to t, or change its subscription, and send the current value right away
+        void add(Connection &c, Request &req, CachedTopic *t, double deadband, int64_t interval)
+        {
+            watch(t);
+            remove(c, t);
+            auto s = make_unique<Sub>();
+            s->c = &c;
+            s->topic = t;
+            s->request = string(req.message());
+            s->deadband = deadband;
+            s->interval = max<int64_t>(interval, 0) * 1000000;
+            int64_t age;
+            if (!t->load(value, age)) {
+                value = "null";
+            }
+            send(*s, value);
+            subs.push_back(move(s));
+        }
+
+        bool remove(Connection &c, CachedTopic *t)
+        {
+            for (size_t k = 0; k < subs.size(); k++) {
+                if (subs[k]->c == &c && subs[k]->topic == t) {
+                    erase(k);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool subscribed(const Connection &c) const
+        {
+            for (auto &s : subs) {
+                if (s->c == &c) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // the connection is closing
+        void drop(Connection &c)
+        {
+            for (size_t k = subs.size(); k-- > 0;) {
+                if (subs[k]->c == &c) {
+                    erase(k);
+                }
+            }
+        }
+
+        // the eventfd fired, offer the new value of every changed topic to its subscribers
+        void poll()
+        {
+            signaled.store(false);
+            for (auto &w : watches) {
+                if (!w->dirty.exchange(false, memory_order_acquire)) {
+                    continue;
+                }
+                int64_t age;
+                if (!w->topic->load(value, age)) {
+                    continue;
+                }
+                for (auto &s : subs) {
+                    if (s->topic == w->topic) {
+                        offer(*s, value);
+                    }
+                }
+            }
+        }
+
+        // send coalesced updates whose interval has passed and whose connection caught up
+        void tick()
+        {
+            if (pendingCount == 0) {
+                return;
+            }
+            int64_t t = now();
+            for (auto &s : subs) {
+                if (s->hasPending && t - s->lastSent >= s->interval && s->c->output() < SUB_HIGH_WATER) {
+                    string v = move(s->pending);
+                    send(*s, v);
+                    sent.push_back(s->c);
+                }
+            }
+        }
+
+        // ms until the next interval-limited update is due, -1 if none
+        int timeout() const
+        {
+            if (pendingCount == 0) {
+                return -1;
+            }
+            int64_t t = now(), next = -1;
+            for (auto &s : subs) {
+                if (s->hasPending && s->c->output() < SUB_HIGH_WATER) {
+                    int64_t due = max<int64_t>(0, s->lastSent + s->interval - t);
+                    next = next < 0 ? due : min(next, due);
+                }
+            }
+            return next < 0 ? -1 : int((next + 999999) / 1000000);
+        }
+};
+
+}
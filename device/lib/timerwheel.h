@@ -0,0 +1,226 @@
+/*
+ * Source File: timerwheel.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#define WHEEL_BITS      6                       // 64 slots per level
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4                       // 1 ms ticks, 2^24 ms (4.6 hours) ahead
+
+namespace Tcp {
+
+using namespace std;
+
+class TimerWheel;
+
+struct TimerLink
+{
+    TimerLink *prev = this, *next = this;
+};
+
+// intrusive timer, embed it in the object it times, it is cancelled when destroyed
+// fire is called on the event loop thread once the timer is due
+struct Timer : TimerLink
+{
+    function<void()> fire;
+    int64_t due = 0;        // ms on the wheel clock
+    int64_t at = 0;         // tick of the slot it waits in, due or earlier when beyond the wheel
+    int level = 0;
+    TimerWheel *wheel = nullptr;
+
+    Timer() {}
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    inline ~Timer();
+
+    bool armed() const
+    {
+        return wheel != nullptr;
+    }
+};
+
+// hierarchical timing wheel with 1 ms ticks, for one event loop thread
+// arming, re-arming and cancelling are O(1), advance() cascades the due slots of the upper
+// levels down and fires what is due, timeout() tells the loop how long it may sleep
+class TimerWheel
+{
+    TimerLink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    size_t perLevel[WHEEL_LEVELS] = {};
+    size_t count = 0;
+    int64_t current;    // last tick processed
+
+    static int64_t span(int level)
+    {
+        return int64_t(1) << (WHEEL_BITS * level);
+    }
+
+    // put t in the slot of its tick, on the lowest level whose range holds it
+    void link(Timer &t, int64_t earliest)
+    {
+        int64_t top = span(WHEEL_LEVELS);
+        // beyond this rotation of the top level it waits at the last tick and is linked again then
+        t.at = min(max(t.due, earliest), max((current & ~(top - 1)) + top - 1, earliest));
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && ((t.at ^ current) >> (WHEEL_BITS * (level + 1))) != 0) {
+            level++;
+        }
+        TimerLink &head = slots[level][(t.at >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+        t.prev = head.prev;
+        t.next = &head;
+        head.prev->next = &t;
+        head.prev = &t;
+        t.level = level;
+        t.wheel = this;
+        perLevel[level]++;
+        count++;
+    }
+
+    void unlink(Timer &t)
+    {
+        t.prev->next = t.next;
+        t.next->prev = t.prev;
+        t.prev = t.next = &t;
+        t.wheel = nullptr;
+        perLevel[t.level]--;
+        count--;
+    }
+
+    // move the timers of an upper level slot down, the ones due now land in the slot fired next
+    void cascade(TimerLink &head)
+    {
+        while (head.next != &head) {
+            Timer &t = static_cast<Timer &>(*head.next);
+            unlink(t);
+            link(t, current);
+        }
+    }
+
+    // fire the timers of the current slot, the callbacks may arm and cancel timers freely
+    void fire(TimerLink &head)
+    {
+        while (head.next != &head) {
+            Timer &t = static_cast<Timer &>(*head.next);
+            unlink(t);
+            if (t.due > current) {
+                // it was beyond the wheel
+                link(t, current + 1);
+            }
+            else if (t.fire) {
+                t.fire();
+            }
+        }
+    }
+
+    public:
+        TimerWheel() : current{clock()} {}
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+        ~TimerWheel()
+        {
+            for (auto &level : slots) {
+                for (auto &head : level) {
+                    while (head.next != &head) {
+                        unlink(static_cast<Timer &>(*head.next));
+                    }
+                }
+            }
+        }
+
+        static int64_t clock()
+        {
+            return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // the wheel's time in ms, as of the last advance()
+        int64_t now() const
+        {
+            return current;
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        // arm or re-arm t to fire at due (wheel ms), a due time already past fires on the next advance()
+        void schedule(Timer &t, int64_t due)
+        {
+            if (t.wheel) {
+                unlink(t);
+            }
+            t.due = due;
+            link(t, current + 1);
+        }
+
+        void cancel(Timer &t)
+        {
+            if (t.wheel) {
+                unlink(t);
+            }
+        }
+
+        // move the wheel to the current time and fire every timer that is due
+        void advance()
+        {
+            int64_t now = clock();
+            while (current < now) {
+                // jump over ticks where no level has anything to fire or cascade
+                int64_t step = 1;
+                for (int level = 0; level < WHEEL_LEVELS - 1 && perLevel[level] == 0; level++) {
+                    step = span(level + 1) - (current & (span(level + 1) - 1));
+                }
+                current = count == 0 ? now : min(current + step, now);
+
+                // at a slot boundary of an upper level its timers move down, highest level first
+                for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+                    if ((current & (span(level) - 1)) == 0) {
+                        cascade(slots[level][(current >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+                    }
+                }
+                fire(slots[0][current & (WHEEL_SLOTS - 1)]);
+            }
+        }
+
+        // ms until the next timer is due, -1 if none, for epoll_wait() and io_uring_enter()
+        int timeout() const
+        {
+            if (count == 0) {
+                return -1;
+            }
+            int64_t next = INT64_MAX;
+            for (int level = 0; level < WHEEL_LEVELS; level++) {
+                if (perLevel[level] == 0) {
+                    continue;
+                }
+                // the first occupied slot of this level in rotation order holds its earliest timers
+                int64_t base = current >> (WHEEL_BITS * level);
+                for (int k = level == 0 ? 1 : 0; k <= WHEEL_SLOTS; k++) {
+                    const TimerLink &head = slots[level][(base + k) & (WHEEL_SLOTS - 1)];
+                    if (head.next == &head) {
+                        continue;
+                    }
+                    for (const TimerLink *p = head.next; p != &head; p = p->next) {
+                        next = min(next, static_cast<const Timer *>(p)->at);
+                    }
+                    break;
+                }
+            }
+            return int(clamp<int64_t>(next - clock(), 0, INT32_MAX));
+        }
+};
+
+Timer::~Timer()
+{
+    if (wheel) {
+        wheel->cancel(*this);
+    }
+}
+
+}
@@ -0,0 +1,268 @@
+/*
+ * Source File: topiccache.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "connection.h"
+#include "log.h"
+#include "request.h"
+
+#define TOPIC_VALUE_MAX 256     // default slot size in bytes of a serialized value
+
+namespace Tcp {
+
+using namespace std;
+
+// a sensor read or any other slow value source, returns the value as serialized json
+// e.g. "\"42\"" or "{\"t\":21.5}", quoteJson() turns plain text into a json string
+using Sampler = function<string()>;
+
+inline string quoteJson(string_view v)
+{
+    string out;
+    appendQuoted(out, v);
+    return out;
+}
+
+struct SourceOptions
+{
+    int period = 1000;      // ms between samples
+    int64_t maxAge = -1;    // ms, older values are sampled again inside the request, -1 any age
+    size_t maxBytes = TOPIC_VALUE_MAX;
+};
+
+// latest value of one topic, written by the sampler threads and read lock-free by any
+// event loop thread through a seqlock, a reader retries only while a write is in progress
+class CachedTopic
+{
+    alignas(64) atomic<uint64_t> seq{0};    // odd while a write is in progress
+    atomic<int64_t> stamp{0};               // steady clock ns of the value, 0 before the first sample
+    atomic<uint32_t> len{0};
+    unique_ptr<char[]> data;
+    mutex writers;      // the sampler threads and a request that samples a stale value
+    mutex watchLock;
+    vector<pair<int, function<void()>>> watchers;
+    int watchId = 0;
+
+    static int64_t now()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    public:
+        CachedTopic(string n, Sampler s, SourceOptions o) : data{new char[o.maxBytes]}, name{move(n)}, sampler{move(s)}, opt{o} {}
+
+        const string name;
+        const Sampler sampler;
+        const SourceOptions opt;
+
+        void publish(string_view v)
+        {
+            if (v.size() > opt.maxBytes) {
+                LOG_WARN("topic %s value of %zu bytes exceeds its %zu byte slot", name.c_str(), v.size(), opt.maxBytes);
+                return;
+            }
+            lock_guard<mutex> g(writers);
+            uint64_t s = seq.load(memory_order_relaxed);
+            seq.store(s + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            memcpy(data.get(), v.data(), v.size());
+            len.store(uint32_t(v.size()), memory_order_relaxed);
+            stamp.store(now(), memory_order_relaxed);
+            seq.store(s + 2, memory_order_release);
+
+            lock_guard<mutex> w(watchLock);
+            for (auto &[id, f] : watchers) {
+                f();
+            }
+        }
+
+        // f is called on the publishing thread after every new value, it must not block
+        // returns an id for unwatch()
+        int watch(function<void()> f)
+        {
+            lock_guard<mutex> w(watchLock);
+            watchers.emplace_back(++watchId, move(f));
+            return watchId;
+        }
+
+        void unwatch(int id)
+        {
+            lock_guard<mutex> w(watchLock);
+            erase_if(watchers, [id](auto &p) { return p.first == id; });
+        }
+
+        // call the sampler and publish its value, false if it threw
+        bool sample()
+        {
+            try
+            {
+                publish(sampler());
+                return true;
+            }
+            catch (exception& e)
+            {
+                LOG_WARN("topic %s sampler error: %s", name.c_str(), e.what());
+                return false;
+            }
+        }
+
+        // copy the latest value into out, age is how old it is in ms
+        // false if there is no value yet
+        bool load(string &out, int64_t &age) const
+        {
+            for (;;) {
+                uint64_t s = seq.load(memory_order_acquire);
+                if (s & 1) {
+                    this_thread::yield();
+                    continue;
+                }
+                uint32_t n = len.load(memory_order_relaxed);
+                int64_t t = stamp.load(memory_order_relaxed);
+                out.resize(n);
+                memcpy(out.data(), data.get(), n);
+                atomic_thread_fence(memory_order_acquire);
+                if (seq.load(memory_order_relaxed) == s) {
+                    age = (now() - t) / 1000000;
+                    return t != 0;
+                }
+            }
+        }
+
+        // the latest value no older than maxAge ms (-1 uses the topic default), sampled here if
+        // the cache cannot satisfy that, false if the sampler failed
+        bool get(string &out, int64_t maxAge = -1)
+        {
+            int64_t age;
+            int64_t limit = maxAge >= 0 ? maxAge : opt.maxAge;
+            if (load(out, age) && (limit < 0 || age <= limit)) {
+                return true;
+            }
+            return sample() && load(out, age);
+        }
+};
+
+// topics whose values are sampled in the background at their own period, requests are
+// answered from the cache so their latency does not depend on how slow the source is
+//
+// TopicCache cache;
+// auto t = cache.add("random-data", [] { return quoteJson(getRandomData()); }, {100});
+// router.on("node-edge-read", "random-data", cache.reader(t));
+class TopicCache
+{
+    struct Due
+    {
+        chrono::steady_clock::time_point at;
+        CachedTopic *topic;
+        bool operator>(const Due &d) const { return at > d.at; }
+    };
+
+    vector<unique_ptr<CachedTopic>> topics;
+    priority_queue<Due, vector<Due>, greater<Due>> schedule;
+    mutex lock;         // guards topics and schedule
+    condition_variable changed;
+    vector<thread> samplers;
+    bool stopped = false;
+
+    void run()
+    {
+        unique_lock<mutex> g(lock);
+        while (!stopped) {
+            if (schedule.empty()) {
+                changed.wait(g);
+                continue;
+            }
+            Due d = schedule.top();
+            if (d.at > chrono::steady_clock::now()) {
+                // woken early when stopped or an earlier topic was added, look again either way
+                changed.wait_until(g, d.at);
+                continue;
+            }
+            schedule.pop();
+            // the next sample is due one period after this one was, not after it finished
+            auto next = max(d.at + chrono::milliseconds(d.topic->opt.period), chrono::steady_clock::now());
+            g.unlock();
+            d.topic->sample();
+            g.lock();
+            schedule.push(Due{next, d.topic});
+        }
+    }
+
+    public:
+        // threads sample the topics in parallel, more threads keep one slow source
+        // from delaying the others
+        explicit TopicCache(unsigned threads = 2)
+        {
+            for (unsigned k = 0; k < max(threads, 1u); k++) {
+                samplers.emplace_back([this] { run(); });
+            }
+        }
+        TopicCache(const TopicCache&) = delete;
+        TopicCache& operator=(const TopicCache&) = delete;
+
+        ~TopicCache()
+        {
+            {
+                lock_guard<mutex> g(lock);
+                stopped = true;
+            }
+            changed.notify_all();
+            for (auto &t : samplers) {
+                t.join();
+            }
+        }
+
+        // start sampling a topic, the first sample is taken before add() returns
+        CachedTopic *add(const string &name, Sampler sampler, SourceOptions opt = {})
+        {
+            auto t = make_unique<CachedTopic>(name, move(sampler), opt);
+            t->sample();
+            CachedTopic *p = t.get();
+            {
+                lock_guard<mutex> g(lock);
+                topics.push_back(move(t));
+                schedule.push(Due{chrono::steady_clock::now() + chrono::milliseconds(opt.period), p});
+            }
+            changed.notify_one();
+            return p;
+        }
+
+        CachedTopic *find(const string &name)
+        {
+            lock_guard<mutex> g(lock);
+            for (auto &t : topics) {
+                if (t->name == name) {
+                    return t.get();
+                }
+            }
+            return nullptr;
+        }
+
+        // route handler replying with the cached value of t, honouring the request's "maxAge"
+        static function<void(Connection&, Request&)> reader(CachedTopic *t)
+        {
+            return [t](Connection &c, Request &req) {
+                thread_local string v;
+                if (!t->get(v, req.maxAge)) {
+                    v = "null";
+                }
+                c.write(req.replyJson(v));
+            };
+        }
+};
+
+}
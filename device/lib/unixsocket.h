@@ -0,0 +1,101 @@
+/*
+ * Source File: unixsocket.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include "socketerror.h"
+
+namespace Tcp {
+
+using namespace std;
+
+// fill addr for a unix domain socket path, a leading '@' selects the linux abstract namespace
+// returns the address length to pass to bind() or connect()
+inline socklen_t unixAddress(const string &path, sockaddr_un &addr)
+{
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw SocketError("Invalid unix socket path");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    if (path[0] == '@') {
+        // abstract names are not nul terminated, the length tells where they end
+        addr.sun_path[0] = '\0';
+        return offsetof(sockaddr_un, sun_path) + path.size();
+    }
+    return sizeof(addr);
+}
+
+// send n file descriptors and a small payload over a connected unix domain socket
+inline bool sendFds(int sock, const int *fds, int n, const void *data, size_t len)
+{
+    char ctl[CMSG_SPACE(sizeof(int) * 8)] = {};
+    if (n > 8) {
+        return false;
+    }
+    iovec iov{const_cast<void *>(data), len};
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (n > 0) {
+        mh.msg_control = ctl;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * n);
+    }
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == ssize_t(len);
+}
+
+// receive up to n file descriptors sent with sendFds(), returns how many arrived or -1 on error
+inline int recvFds(int sock, int *fds, int n, void *data, size_t len)
+{
+    char ctl[CMSG_SPACE(sizeof(int) * 8)] = {};
+    iovec iov{data, len};
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+    if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) <= 0) {
+        return -1;
+    }
+    int got = 0;
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            int cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int k = 0; k < cnt; k++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cm) + k * sizeof(int), sizeof(int));
+                if (got < n) {
+                    fds[got++] = fd;
+                }
+                else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    return got;
+}
+
+// pid, uid and gid of the process at the other end of a connected unix domain socket
+inline bool peerCredentials(int fd, ucred &cred)
+{
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0;
+}
+
+}
+
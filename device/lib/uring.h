@@ -0,0 +1,394 @@
+/*
+ * Source File: uring.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "log.h"
+#include "outqueue.h"
+
+// the io_uring backend needs the kernel 6.0 uapi header (multishot recv, provided buffer rings)
+// build with -DEDGE_URING=0 to leave it out, the server then always uses epoll
+#ifndef EDGE_URING
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#ifdef IORING_RECV_MULTISHOT
+#define EDGE_URING 1
+#else
+#define EDGE_URING 0
+#endif
+#elif EDGE_URING
+#include <linux/io_uring.h>
+#endif
+
+#define URING_ENTRIES   256     // submission queue size, the completion queue is 4 times that
+#define URING_BUFFERS   256     // provided receive buffers per ring, a power of two
+#define URING_BUF_SIZE  4096
+
+namespace Tcp {
+
+using namespace std;
+
+class Connection;
+
+// io_uring state of one connection, the server submits the output queue itself and
+// keeps the connection until neither its receive nor its send is in flight
+struct UringIo
+{
+    vector<Connection*> *sendQueue;     // connections with replies for the next submission batch
+    bool queued = false;    // in sendQueue
+    bool receiving = false; // multishot recv armed
+    bool sending = false;   // a sendmsg is in flight, msg and iov belong to it
+    bool closing = false;   // cancel submitted, released once nothing is in flight
+    bool paused = false;    // recv cancelled while the connection is over its limits
+    bool handing = false;   // recv cancelled to hand the connection to the next instance
+    msghdr msg{};
+    iovec iov[MAX_IOV];
+
+    explicit UringIo(vector<Connection*> *q) : sendQueue{q} {}
+};
+
+#if EDGE_URING
+
+// a minimal io_uring instance without liburing: the mapped submission and completion rings
+// and one provided buffer ring that multishot receives pick their buffers from
+class Uring
+{
+    int fd = -1;
+    unsigned features = 0;
+
+    void *sqMap = MAP_FAILED;   // both rings, IORING_FEAT_SINGLE_MMAP
+    size_t sqMapSize = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *) MAP_FAILED;
+    unsigned sqEntries = 0;
+    unsigned *sqHead, *sqTail, *sqMask;
+    unsigned tail = 0;      // local submission tail, published by submit()
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    // the buffer ring as a plain array, in C++ the flexible bufs[] of io_uring_buf_ring lands 8 bytes
+    // too far, the ring tail is the resv field of entry 0
+    io_uring_buf *bufRing = (io_uring_buf *) MAP_FAILED;
+    size_t bufRingSize = 0;
+    unique_ptr<char[]> buffers;
+    unsigned short bufTail = 0;
+
+    static int enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argSize)
+    {
+        return int(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argSize));
+    }
+
+    static int registerOp(int fd, unsigned op, void *arg, unsigned n)
+    {
+        return int(syscall(__NR_io_uring_register, fd, op, arg, n));
+    }
+
+    bool setup()
+    {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries = URING_ENTRIES * 4;
+        fd = int(syscall(__NR_io_uring_setup, URING_ENTRIES, &p));
+        if (fd < 0) {
+            return false;
+        }
+        features = p.features;
+        if (!(features & IORING_FEAT_SINGLE_MMAP) || !(features & IORING_FEAT_EXT_ARG) || !(features & IORING_FEAT_NODROP)) {
+            errno = ENOTSUP;
+            return false;
+        }
+
+        sqMapSize = max(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED) {
+            return false;
+        }
+        sqes = (io_uring_sqe *) mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char *sq = (char *) sqMap;
+        sqEntries = p.sq_entries;
+        sqHead = (unsigned *) (sq + p.sq_off.head);
+        sqTail = (unsigned *) (sq + p.sq_off.tail);
+        sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+        // slot k of the submission array always points at sqe k
+        unsigned *array = (unsigned *) (sq + p.sq_off.array);
+        for (unsigned k = 0; k < sqEntries; k++) {
+            array[k] = k;
+        }
+        tail = *sqTail;
+
+        // one mapping holds both rings with IORING_FEAT_SINGLE_MMAP
+        cqHead = (unsigned *) (sq + p.cq_off.head);
+        cqTail = (unsigned *) (sq + p.cq_off.tail);
+        cqMask = (unsigned *) (sq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (sq + p.cq_off.cqes);
+        return true;
+    }
+
+    // the opcodes the server submits
+    bool probe()
+    {
+        size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        unique_ptr<char[]> mem(new char[size]());
+        auto *pr = (io_uring_probe *) mem.get();
+        if (registerOp(fd, IORING_REGISTER_PROBE, pr, 256) < 0) {
+            return false;
+        }
+        for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL}) {
+            if (op > pr->last_op || !(pr->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                errno = ENOTSUP;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool setupBuffers()
+    {
+        bufRingSize = URING_BUFFERS * sizeof(io_uring_buf);
+        bufRing = (io_uring_buf *) mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bufRing == MAP_FAILED) {
+            return false;
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = uint64_t(bufRing);
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = bufferGroup;
+        if (registerOp(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return false;
+        }
+        buffers.reset(new char[size_t(URING_BUFFERS) * URING_BUF_SIZE]);
+        for (unsigned k = 0; k < URING_BUFFERS; k++) {
+            putBuffer(k);
+        }
+        publishBuffers();
+        return true;
+    }
+
+    // multishot recv came in 6.0, a kernel with provided buffer rings but without it
+    // only says so in the completion, try one on a socketpair
+    bool selfTest()
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+            return false;
+        }
+        recv(sv[0], 1);
+        bool ok = ::write(sv[1], "x", 1) == 1 && submit(1, 1000) >= 0;
+        io_uring_cqe c{};
+        ok = ok && next(c) && c.res == 1 && (c.flags & IORING_CQE_F_MORE);
+        if (next(c)) {
+            advance();
+        }
+        if (ok) {
+            recycle(c.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        // the cancel and, if it is still armed, the end of the recv
+        cancel(sv[0]);
+        for (int n = 0; n < (ok ? 2 : 1) && submit(1, 1000) >= 0;) {
+            while (next(c)) {
+                advance();
+                n++;
+            }
+        }
+        close(sv[0]);
+        close(sv[1]);
+        if (!ok) {
+            errno = ENOTSUP;
+        }
+        return ok;
+    }
+
+    void putBuffer(unsigned short bid)
+    {
+        io_uring_buf &b = bufRing[bufTail & (URING_BUFFERS - 1)];
+        b.addr = uint64_t(buffers.get() + size_t(bid) * URING_BUF_SIZE);
+        b.len = URING_BUF_SIZE;
+        b.bid = bid;
+        bufTail++;
+    }
+
+    void publishBuffers()
+    {
+        __atomic_store_n(&bufRing[0].resv, bufTail, __ATOMIC_RELEASE);
+    }
+
+    public:
+        static constexpr unsigned short bufferGroup = 0;
+
+        Uring() {}
+        Uring(const Uring&) = delete;
+        Uring& operator=(const Uring&) = delete;
+        ~Uring()
+        {
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (bufRing != MAP_FAILED) {
+                munmap(bufRing, bufRingSize);
+            }
+            if (sqes != MAP_FAILED) {
+                munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+            }
+            if (sqMap != MAP_FAILED) {
+                munmap(sqMap, sqMapSize);
+            }
+        }
+
+        // set up the rings on the calling thread, false with errno set if this kernel
+        // (or a seccomp policy, or kernel.io_uring_disabled) does not allow what the server needs
+        bool open()
+        {
+            return setup() && probe() && setupBuffers() && selfTest();
+        }
+
+        // next free submission entry, cleared, submits the queued ones first if the ring is full
+        io_uring_sqe *sqe()
+        {
+            if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+                submit(0, -1);
+            }
+            io_uring_sqe *e = &sqes[tail & *sqMask];
+            memset(e, 0, sizeof(*e));
+            tail++;
+            return e;
+        }
+
+        // hand the queued entries to the kernel and wait for at least wait completions,
+        // at most timeout ms (-1 no limit), returns -1 with errno set on error, ETIME on timeout
+        int submit(unsigned wait, int timeout)
+        {
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            unsigned pending = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            io_uring_getevents_arg arg{};
+            __kernel_timespec ts{timeout / 1000, (timeout % 1000) * 1000000LL};
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = timeout >= 0 ? uint64_t(&ts) : 0;
+            unsigned flags = IORING_ENTER_EXT_ARG | (wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+            if (wait > 0 && next()) {
+                wait = 0;   // completions are waiting already, only submit
+                flags &= ~IORING_ENTER_GETEVENTS;
+            }
+            return enter(fd, pending, wait, flags, &arg, sizeof(arg));
+        }
+
+        // true if a completion is ready
+        bool next() const
+        {
+            return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        }
+
+        // copy the oldest completion, call advance() when done with it
+        bool next(io_uring_cqe &c) const
+        {
+            unsigned head = *cqHead;
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+            c = cqes[head & *cqMask];
+            return true;
+        }
+
+        void advance()
+        {
+            __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+        }
+
+        // data of a provided buffer named by a completion
+        const char *buffer(unsigned bid) const
+        {
+            return buffers.get() + size_t(bid) * URING_BUF_SIZE;
+        }
+
+        // give a provided buffer back to the kernel
+        void recycle(unsigned bid)
+        {
+            putBuffer((unsigned short) bid);
+            publishBuffers();
+        }
+
+        void accept(int sockfd, uint64_t data)
+        {
+            io_uring_sqe *e = sqe();
+            e->opcode = IORING_OP_ACCEPT;
+            e->fd = sockfd;
+            e->ioprio = IORING_ACCEPT_MULTISHOT;
+            e->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            e->user_data = data;
+        }
+
+        // receive into provided buffers until cancelled or the peer closes
+        void recv(int fd, uint64_t data)
+        {
+            io_uring_sqe *e = sqe();
+            e->opcode = IORING_OP_RECV;
+            e->fd = fd;
+            e->ioprio = IORING_RECV_MULTISHOT;
+            e->flags = IOSQE_BUFFER_SELECT;
+            e->buf_group = bufferGroup;
+            e->user_data = data;
+        }
+
+        void sendmsg(int fd, const msghdr *msg, uint64_t data)
+        {
+            io_uring_sqe *e = sqe();
+            e->opcode = IORING_OP_SENDMSG;
+            e->fd = fd;
+            e->addr = uint64_t(msg);
+            e->len = 1;
+            e->msg_flags = MSG_NOSIGNAL;
+            e->user_data = data;
+        }
+
+        // readiness of fd until cancelled
+        void poll(int fd, uint32_t events, uint64_t data)
+        {
+            io_uring_sqe *e = sqe();
+            e->opcode = IORING_OP_POLL_ADD;
+            e->fd = fd;
+            e->len = IORING_POLL_ADD_MULTI;
+            e->poll32_events = events;
+            e->user_data = data;
+        }
+
+        // cancel every request on fd, or every request at all with fd -1
+        void cancel(int fd, uint64_t data = 0)
+        {
+            io_uring_sqe *e = sqe();
+            e->opcode = IORING_OP_ASYNC_CANCEL;
+            e->fd = fd;
+            e->cancel_flags = IORING_ASYNC_CANCEL_ALL | (fd < 0 ? IORING_ASYNC_CANCEL_ANY : IORING_ASYNC_CANCEL_FD);
+            e->user_data = data;
+        }
+
+        // cancel the one request submitted with user data target
+        void cancelRequest(uint64_t target, uint64_t data)
+        {
+            io_uring_sqe *e = sqe();
+            e->opcode = IORING_OP_ASYNC_CANCEL;
+            e->fd = -1;
+            e->addr = target;
+            e->user_data = data;
+        }
+};
+
+#endif
+
+}
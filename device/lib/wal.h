@@ -0,0 +1,618 @@
+/*
+ * Source File: wal.h
+ * Author: Ed Alegrid
+ * Copyright (c) 2022 Ed Alegrid <ealegrid@gmail.com>
+ * GNU General Public License v3.0
+ */
+#pragma once
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "framing.h"
+#include "log.h"
+#include "socketerror.h"
+
+#define WAL_SEGMENT     (16 << 20)      // default bytes of a segment file
+
+namespace Tcp {
+
+using namespace std;
+
+struct WalOptions
+{
+    size_t segment = WAL_SEGMENT;   // bytes of a segment file, allocated when it is created
+    int window = 2;                 // ms a batch collects writes before its one fdatasync
+    size_t keep = 4;                // full segments kept before they are compacted into one
+};
+
+// write-ahead log of the requests of write topics, see Router::logged()
+//
+// a directory of segment files named by the sequence number of their first record, the
+// newest one is allocated up front and appended to through a shared mapping, so making a
+// batch durable is one fdatasync that does not have to change the file size
+// every record carries a crc, replay stops at the first one that does not match, e.g. a
+// record torn by a crash, nothing after it was acknowledged
+// a batch whose sync failed is voided by a record after it, replay and compaction skip it
+// compaction folds the full segments into one that keeps the newest write of every topic, on a
+// thread of its own so the batches synced meanwhile are not held up
+class WriteLog
+{
+    // a record is the header, the key and the message, padded to 8 bytes
+    struct Header
+    {
+        uint32_t len;       // bytes of key and message, 0 where the records end
+        uint32_t crc;       // of the rest of the header, the key and the message
+        uint64_t seq;
+        uint16_t keyLen;
+        uint8_t enc;
+        uint8_t kind;       // Kind
+        uint8_t pad[4];
+    };
+
+    enum Kind : uint8_t
+    {
+        Write,
+        Void        // the message holds the first and last seq of a batch that is not durable
+    };
+
+    struct Segment
+    {
+        uint64_t first;
+        string path;
+    };
+
+    string dir;
+    WalOptions opt;
+    int dirfd = -1;
+    vector<Segment> sealed;     // full segments, oldest first
+    Segment active;
+    int fd = -1;
+    char *base = nullptr;
+    size_t capacity = 0, used = 0;
+    vector<int> rolled;         // sealed segments the committer has not synced yet
+    bool dirDirty = false;      // a segment file was created since the last sync
+    uint64_t nextSeq = 1, durable = 0;
+    vector<pair<uint64_t, uint64_t>> voided;    // seq ranges of failed batches, see noteVoided()
+    vector<pair<uint64_t, function<void(bool)>>> waiting;   // in seq order
+    bool idle = true;           // the committer waits for work
+    bool stopped = false;
+    bool fold = false;          // the compactor has work
+    bool closing = false;       // the compactor stops, set once the committer has
+    mutex lock;
+    mutex files;                // held while replay() or compact() read the segment files
+    condition_variable wake, synced, folding;
+    thread committer, compactor;
+
+    static uint32_t crc32(const char *p, size_t n)
+    {
+        static const auto table = [] {
+            array<uint32_t, 256> t{};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+                t[i] = c;
+            }
+            return t;
+        }();
+        uint32_t crc = ~0u;
+        while (n--) {
+            crc = table[(crc ^ uint8_t(*p++)) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    static size_t recordSize(size_t key, size_t msg)
+    {
+        return (sizeof(Header) + key + msg + 7) & ~size_t(7);
+    }
+
+    // call f(header, key, msg) for every valid record in the n bytes at p,
+    // returns the offset after the last one
+    template<class F>
+    static size_t scan(const char *p, size_t n, F f)
+    {
+        size_t at = 0;
+        while (at + sizeof(Header) <= n) {
+            Header h;
+            memcpy(&h, p + at, sizeof(h));
+            if (h.len == 0 || h.keyLen > h.len || at + recordSize(0, h.len) > n) {
+                break;
+            }
+            if (crc32(p + at + 8, sizeof(Header) - 8 + h.len) != h.crc) {
+                LOG_WARN("write log record %llu is damaged, the log ends before it", (unsigned long long)h.seq);
+                break;
+            }
+            const char *key = p + at + sizeof(Header);
+            f(h, string_view(key, h.keyLen), string_view(key + h.keyLen, h.len - h.keyLen));
+            at += recordSize(0, h.len);
+        }
+        return at;
+    }
+
+    // map the segment file at path read only and scan it, false if a damaged record ends it
+    template<class F>
+    static bool scanFile(const string &path, F f)
+    {
+        int r = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (r < 0 || fstat(r, &st) < 0) {
+            LOG_ERROR("write log %s: %s", path.c_str(), strerror(errno));
+            if (r >= 0) {
+                close(r);
+            }
+            return false;
+        }
+        bool whole = true;
+        if (st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, r, 0);
+            if (p != MAP_FAILED) {
+                const char *b = static_cast<const char *>(p);
+                size_t n = st.st_size, at = scan(b, n, f);
+                // the records end at the end of the file or at a zero length
+                uint32_t len = 0;
+                if (at + sizeof(len) <= n) {
+                    memcpy(&len, b + at, sizeof(len));
+                }
+                whole = len == 0;
+                munmap(p, st.st_size);
+            }
+        }
+        close(r);
+        return whole;
+    }
+
+    // note the batch voided by a Void record in v
+    static void noteVoided(const Header &h, string_view msg, vector<pair<uint64_t, uint64_t>> &v)
+    {
+        if (h.kind == Void && msg.size() == 16) {
+            uint64_t r[2];
+            memcpy(r, msg.data(), sizeof(r));
+            v.emplace_back(r[0], r[1]);
+        }
+    }
+
+    static bool isVoided(const vector<pair<uint64_t, uint64_t>> &v, uint64_t seq)
+    {
+        for (auto &r : v) {
+            if (seq >= r.first && seq <= r.second) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // build a record of kind at p, it takes recordSize(key.size(), msg.size()) bytes
+    static void record(char *p, uint64_t seq, Kind kind, string_view key, Encoding enc, string_view msg)
+    {
+        Header h{uint32_t(key.size() + msg.size()), 0, seq, uint16_t(key.size()), uint8_t(enc), kind, {}};
+        memcpy(p, &h, sizeof(h));
+        memcpy(p + sizeof(h), key.data(), key.size());
+        memcpy(p + sizeof(h) + key.size(), msg.data(), msg.size());
+        memset(p + sizeof(h) + h.len, 0, recordSize(key.size(), msg.size()) - sizeof(h) - h.len);
+        h.crc = crc32(p + 8, sizeof(Header) - 8 + h.len);
+        memcpy(p + 4, &h.crc, sizeof(h.crc));
+    }
+
+    // append a record and return its seq, 0 if it does not fit, the lock is held
+    uint64_t put(Kind kind, string_view key, Encoding enc, string_view msg)
+    {
+        size_t size = recordSize(key.size(), msg.size());
+        if (size > opt.segment || key.size() > UINT16_MAX) {
+            return 0;
+        }
+        if (used + size > capacity && !roll()) {
+            return 0;
+        }
+        record(base + used, nextSeq, kind, key, enc, msg);
+        used += size;
+        return nextSeq++;
+    }
+
+    string segmentPath(uint64_t first) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.wal", (unsigned long long)first);
+        return dir + name;
+    }
+
+    // map the segment s as the one appended to, created with size bytes if it is new
+    bool map(const Segment &s, size_t size)
+    {
+        int f = open(s.path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (f < 0 || fstat(f, &st) < 0) {
+            if (f >= 0) {
+                close(f);
+            }
+            return false;
+        }
+        size_t n = max(size_t(st.st_size), size);
+        void *p = MAP_FAILED;
+        if ((size_t(st.st_size) == n || posix_fallocate(f, 0, n) == 0 || ftruncate(f, n) == 0) &&
+            (p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0)) != MAP_FAILED) {
+            active = s;
+            fd = f;
+            base = static_cast<char *>(p);
+            capacity = n;
+            return true;
+        }
+        int e = errno;
+        close(f);
+        errno = e;
+        return false;
+    }
+
+    // the active segment is full, the next records go to a new one, the lock is held
+    bool roll()
+    {
+        Segment full = active;
+        int f = fd;
+        char *p = base;
+        size_t n = capacity;
+        if (!map(Segment{nextSeq, segmentPath(nextSeq)}, opt.segment)) {
+            LOG_ERROR("write log segment error: %s", strerror(errno));
+            return false;
+        }
+        munmap(p, n);
+        rolled.push_back(f);
+        sealed.push_back(full);
+        used = 0;
+        dirDirty = true;
+        return true;
+    }
+
+    // one fdatasync for everything appended since the last batch, then the acks
+    void commit()
+    {
+        unique_lock<mutex> g(lock);
+        for (;;) {
+            idle = true;
+            wake.wait(g, [this] { return stopped || nextSeq - 1 > durable; });
+            idle = false;
+            if (nextSeq - 1 == durable) {
+                break;
+            }
+            if (opt.window > 0 && !stopped) {
+                // let the batch fill up
+                g.unlock();
+                this_thread::sleep_for(chrono::milliseconds(opt.window));
+                g.lock();
+            }
+            uint64_t target = nextSeq - 1;
+            int f = fd;
+            auto full = move(rolled);
+            rolled.clear();
+            bool dirs = exchange(dirDirty, false);
+            g.unlock();
+
+            // a full segment's fd is closed here, the active one only by roll() and the destructor
+            bool ok = true;
+            for (int r : full) {
+                ok = fdatasync(r) == 0 && ok;
+                close(r);
+            }
+            ok = fdatasync(f) == 0 && ok;
+            if (dirs) {
+                ok = fsync(dirfd) == 0 && ok;
+            }
+            if (!ok) {
+                LOG_ERROR("write log sync error: %s", strerror(errno));
+            }
+
+            g.lock();
+            if (!ok) {
+                // the batch is refused, replay must not bring it back should it be on disk anyway
+                uint64_t r[2] = {durable + 1, target};
+                voided.emplace_back(r[0], r[1]);
+                put(Void, {}, Encoding::Json, string_view(reinterpret_cast<const char *>(r), sizeof(r)));
+            }
+            durable = target;
+            // in seq order, a caller that applies the writes in its acks applies them as replay() does
+            vector<function<void(bool)>> acks;
+            erase_if(waiting, [&](auto &w) {
+                if (w.first > target) {
+                    return false;
+                }
+                acks.push_back(move(w.second));
+                return true;
+            });
+            bool more = !fold && sealed.size() > opt.keep;
+            fold = fold || more;
+            g.unlock();
+            synced.notify_all();
+            if (more) {
+                folding.notify_one();
+            }
+            for (auto &a : acks) {
+                a(ok);
+            }
+            g.lock();
+        }
+    }
+
+    // compact whenever the committer finds too many full segments, a fold asked for while the
+    // log closes still runs
+    void compaction()
+    {
+        unique_lock<mutex> g(lock);
+        for (;;) {
+            folding.wait(g, [this] { return closing || fold; });
+            if (!fold) {
+                break;
+            }
+            fold = false;
+            g.unlock();
+            compact();
+            g.lock();
+        }
+    }
+
+    // fold the full segments into one with the newest record of every key, it takes the name
+    // of the oldest one so it is replayed first, the records of the others are older than its
+    // last one and replay() skips them should a crash leave them behind
+    // only full segments whose records are all synced are folded, the committer may still be
+    // syncing the ones sealed since
+    void compact()
+    {
+        lock_guard<mutex> f(files);
+        vector<Segment> old;
+        vector<pair<uint64_t, uint64_t>> skip;
+        {
+            lock_guard<mutex> g(lock);
+            for (size_t k = 0; k < sealed.size(); k++) {
+                uint64_t next = k + 1 < sealed.size() ? sealed[k + 1].first : active.first;
+                if (next - 1 > durable) {
+                    break;
+                }
+                old.push_back(sealed[k]);
+            }
+            skip = voided;
+        }
+        if (old.size() <= opt.keep) {
+            return;
+        }
+        for (auto &s : old) {
+            scanFile(s.path, [&](const Header &h, string_view, string_view msg) { noteVoided(h, msg, skip); });
+        }
+        unordered_map<string, uint64_t> newest;
+        for (auto &s : old) {
+            scanFile(s.path, [&](const Header &h, string_view key, string_view) {
+                if (h.kind == Write && !isVoided(skip, h.seq)) {
+                    uint64_t &n = newest[string(key)];
+                    n = max(n, h.seq);
+                }
+            });
+        }
+
+        string tmp = dir + "/compact.tmp";
+        int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+            LOG_ERROR("write log compaction error: %s", strerror(errno));
+            return;
+        }
+        string buf;
+        bool ok = true;
+        uint64_t written = 0;   // a crash during an earlier compaction may have left duplicates
+        for (auto &s : old) {
+            scanFile(s.path, [&](const Header &h, string_view key, string_view msg) {
+                if (h.kind != Write || newest[string(key)] != h.seq || h.seq <= written) {
+                    return;
+                }
+                written = h.seq;
+                size_t at = buf.size();
+                buf.resize(at + recordSize(key.size(), msg.size()));
+                record(buf.data() + at, h.seq, Write, key, Encoding(h.enc), msg);
+                if (buf.size() >= (1 << 20)) {
+                    ok = ::write(out, buf.data(), buf.size()) == ssize_t(buf.size()) && ok;
+                    buf.clear();
+                }
+            });
+        }
+        ok = ::write(out, buf.data(), buf.size()) == ssize_t(buf.size()) && ok;
+        ok = fdatasync(out) == 0 && ok;
+        close(out);
+        if (!ok || rename(tmp.c_str(), old[0].path.c_str()) < 0 || fsync(dirfd) < 0) {
+            LOG_ERROR("write log compaction error: %s", strerror(errno));
+            unlink(tmp.c_str());
+            return;
+        }
+        for (size_t k = 1; k < old.size(); k++) {
+            unlink(old[k].path.c_str());
+        }
+        {
+            lock_guard<mutex> g(lock);
+            sealed.erase(sealed.begin() + 1, sealed.begin() + old.size());
+        }
+        LOG_INFO("write log compacted %zu segments, %zu topics kept", old.size(), newest.size());
+    }
+
+    public:
+        // open the log in directory, created if it does not exist, replay() before appending
+        explicit WriteLog(string directory, WalOptions o = {}) : dir{move(directory)}, opt{o}
+        {
+            opt.segment = max(opt.segment, size_t(4096));
+            opt.keep = max(opt.keep, size_t(1));
+            if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+                throw SocketError();
+            }
+            dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            DIR *d = opendir(dir.c_str());
+            if (dirfd < 0 || !d) {
+                throw SocketError();
+            }
+            vector<Segment> segs;
+            while (dirent *e = readdir(d)) {
+                string n = e->d_name;
+                if (n.size() == 20 && n.ends_with(".wal")) {
+                    segs.push_back(Segment{strtoull(n.c_str(), nullptr, 16), dir + "/" + n});
+                }
+                else if (n == "compact.tmp") {
+                    // an unfinished compaction, the segments it read are all still there
+                    unlink((dir + "/" + n).c_str());
+                }
+            }
+            closedir(d);
+            sort(segs.begin(), segs.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+            if (segs.empty()) {
+                segs.push_back(Segment{1, segmentPath(1)});
+                dirDirty = true;
+            }
+            Segment newest = segs.back();
+            segs.pop_back();
+            sealed = move(segs);
+            if (!map(newest, opt.segment)) {
+                throw SocketError();
+            }
+
+            // appends go after the last valid record
+            uint64_t last = 0;
+            used = scan(base, capacity, [&](const Header &h, string_view, string_view msg) {
+                last = h.seq;
+                noteVoided(h, msg, voided);
+            });
+            nextSeq = max(active.first, last + 1);
+            durable = nextSeq - 1;
+            // what a crash left beyond it must not pass for records after the next appends
+            size_t end = capacity;
+            while (end > used && base[end - 1] == 0) {
+                end--;
+            }
+            memset(base + used, 0, end - used);
+
+            committer = thread([this] { commit(); });
+            compactor = thread([this] { compaction(); });
+        }
+        WriteLog(const WriteLog&) = delete;
+        WriteLog& operator=(const WriteLog&) = delete;
+
+        // syncs and acknowledges what is still pending
+        ~WriteLog()
+        {
+            {
+                lock_guard<mutex> g(lock);
+                stopped = true;
+            }
+            wake.notify_one();
+            committer.join();
+            {
+                lock_guard<mutex> g(lock);
+                closing = true;
+            }
+            folding.notify_one();
+            compactor.join();
+            munmap(base, capacity);
+            close(fd);
+            close(dirfd);
+        }
+
+        // append the request msg of topic key, returns its sequence number, 0 if it is larger
+        // than a segment or there is no room for a new one, it is durable once whenDurable() says so
+        // with done, done(ok) runs on the committer thread once the batch of the record is
+        // synced, the dones of a batch run in seq order
+        uint64_t append(string_view key, Encoding enc, string_view msg, function<void(bool)> done = nullptr)
+        {
+            unique_lock<mutex> g(lock);
+            uint64_t seq = put(Write, key, enc, msg);
+            if (seq == 0) {
+                return 0;
+            }
+            if (done) {
+                waiting.emplace_back(seq, move(done));
+            }
+            bool notify = idle;
+            g.unlock();
+            if (notify) {
+                wake.notify_one();
+            }
+            return seq;
+        }
+
+        // f(ok) runs once seq is on disk, on the committer thread or right away if it already is,
+        // ok is false if the sync failed
+        void whenDurable(uint64_t seq, function<void(bool)> f)
+        {
+            unique_lock<mutex> g(lock);
+            if (seq > durable) {
+                auto at = find_if(waiting.begin(), waiting.end(), [seq](auto &w) { return w.first > seq; });
+                waiting.emplace(at, seq, move(f));
+                return;
+            }
+            bool ok = !isVoided(voided, seq);
+            g.unlock();
+            f(ok);
+        }
+
+        // block until seq is on disk, false if its batch could not be synced
+        bool sync(uint64_t seq)
+        {
+            unique_lock<mutex> g(lock);
+            synced.wait(g, [this, seq] { return durable >= seq; });
+            return !isVoided(voided, seq);
+        }
+
+        // call f(msg, encoding) for every logged request, oldest first, records that compaction
+        // already folded into a newer one are skipped
+        void replay(const function<void(string_view, Encoding)> &f)
+        {
+            lock_guard<mutex> fl(files);
+            vector<Segment> segs;
+            {
+                lock_guard<mutex> g(lock);
+                segs = sealed;
+            }
+            // the records voiding a failed batch come after it
+            vector<pair<uint64_t, uint64_t>> skip;
+            for (auto &s : segs) {
+                scanFile(s.path, [&skip](const Header &h, string_view, string_view msg) { noteVoided(h, msg, skip); });
+            }
+            {
+                lock_guard<mutex> g(lock);
+                voided.insert(voided.end(), skip.begin(), skip.end());
+                skip = voided;
+            }
+            uint64_t last = 0;
+            size_t n = 0;
+            auto each = [&](const Header &h, string_view, string_view msg) {
+                if (h.kind == Write && h.seq > last && !isVoided(skip, h.seq)) {
+                    n++;
+                    f(msg, Encoding(h.enc));
+                }
+                last = max(last, h.seq);
+            };
+            // nothing after a damaged record is replayed, not even from the later segments
+            bool whole = true;
+            for (auto &s : segs) {
+                if (!(whole = scanFile(s.path, each))) {
+                    break;
+                }
+            }
+            lock_guard<mutex> g(lock);
+            if (whole) {
+                scan(base, used, each);
+            }
+            LOG_INFO("write log replayed %zu records from %zu segments", n, segs.size() + 1);
+        }
+};
+
+}
@@ -0,0 +1,84 @@
+/*
+ * File:   routes.h
+ * Author: Ed Alegrid
+ *
+ * The edge connector topics, shared by device.cpp and the bench.cpp load generator.
+ *
+ */
+
+#pragma once
+#include <mutex>
+#include "lib/log.h"
+#include "lib/router.h"
+#include "lib/topiccache.h"
+
+using namespace std;
+
+inline string name = "";
+inline mutex nameLock; // the workers share the name-data topic
+
+inline auto getRandomData()
+{
+    int rn = rand() % 100 + 10;
+    return to_string(rn);
+}
+
+// one handler per (method, topic), unknown topics get an "invalid topic" reply
+// and rcvd data that is not a json string an "invalid json data" reply
+// print logs every reply at debug level, see Tcp::Log::setLevel(), log keeps the writes across restarts
+inline Tcp::Router edgeRoutes(bool print = true, Tcp::WriteLog *log = nullptr)
+{
+    Tcp::Router router;
+
+    // the sensor stand-in is sampled in the background every 100 ms, reads are answered
+    // from the cache unless the request's "maxAge" asks for a fresher value
+    static Tcp::TopicCache cache;
+    static Tcp::CachedTopic *randomData = cache.add("random-data", [] { return Tcp::quoteJson(getRandomData()); }, {100});
+
+    // handlers read topic, method and payload straight from the rcvd bytes and reply with
+    // the request echoed back with its value set, no json document is built on this path
+    // sensor reads are bulk traffic, under load they are shed before writes and stats
+    router.on("node-edge-read", "random-data", [print](Tcp::Connection &c, Tcp::Request &req)
+    {
+        thread_local string v;
+        if (!randomData->get(v, req.maxAge)) {
+            v = "null";
+        }
+        auto r = req.replyJson(v);
+        c.write(r);
+        if (print) {
+            LOG_DEBUG("read json string result: %s", r.c_str());
+        }
+    }, {.priority = Tcp::Priority::Bulk});
+
+    // clients can also subscribe to the cached value and get pushed its changes
+    router.publish("random-data", randomData);
+
+    // with a write log the writes are acknowledged once they are on disk and replayed at startup
+    auto writeName = [print](Tcp::Request &req)
+    {
+        // the name is a json string, anything else is refused without parsing the whole request
+        if (!req.hasPayload) {
+            return req.reply("write failed, payload is not a string");
+        }
+        lock_guard<mutex> lock(nameLock);
+        name.assign(req.payload);
+        auto r = req.reply("write success");
+        if (print) {
+            LOG_DEBUG("write name: %s", name.c_str());
+            LOG_DEBUG("write json string result: %s", r.c_str());
+        }
+        return r;
+    };
+    if (log) {
+        router.logged("node-edge-write", "name-data", *log, writeName);
+    }
+    else {
+        router.on("node-edge-write", "name-data", [writeName](Tcp::Connection &c, Tcp::Request &req)
+        {
+            c.write(writeName(req));
+        });
+    }
+
+    return router;
+}
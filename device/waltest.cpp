@@ -0,0 +1,209 @@
+/*
+ * File:   waltest.cpp
+ * Author: Ed Alegrid
+ *
+ * Tests of the write-ahead log in lib/wal.h, every case works in a directory of its own under
+ * /tmp, damages the segment files the way a crash or a bad disk would and opens the log again.
+ * Exits with 1 if a check failed.
+ *
+ * $ g++ -Wall -O2 waltest.cpp -o bin/waltest -std=c++20 -pthread
+ * $ ./bin/waltest
+ *
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "lib/wal.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+    cout << (ok ? "ok   " : "FAIL ") << what << endl;
+    if (!ok) {
+        failures++;
+    }
+}
+
+// every record of these tests is 56 bytes, a 24 byte header, a one byte key and a 31 byte message
+#define RECORD 56
+
+static string message(int k)
+{
+    string m = "write-" + to_string(k);
+    m.resize(31, '.');
+    return m;
+}
+
+static string directory(const string &name)
+{
+    string dir = "/tmp/waltest-" + name + "-" + to_string(getpid());
+    system(("rm -rf " + dir).c_str());
+    return dir;
+}
+
+// the segment files of dir, oldest first
+static vector<string> segments(const string &dir)
+{
+    vector<string> files;
+    if (DIR *d = opendir(dir.c_str())) {
+        while (dirent *e = readdir(d)) {
+            if (string(e->d_name).ends_with(".wal")) {
+                files.push_back(dir + "/" + e->d_name);
+            }
+        }
+        closedir(d);
+    }
+    sort(files.begin(), files.end());
+    return files;
+}
+
+// append n records of keys k % topics, each one synced
+static void fill(const string &dir, int n, Tcp::WalOptions opt = {}, int topics = 1)
+{
+    Tcp::WriteLog log(dir, opt);
+    for (int k = 0; k < n; k++) {
+        uint64_t seq = log.append(string(1, char('a' + k % topics)), Tcp::Encoding::Json, message(k));
+        if (seq == 0 || !log.sync(seq)) {
+            check(false, "append " + to_string(k));
+            return;
+        }
+    }
+}
+
+static vector<string> replay(const string &dir, Tcp::WalOptions opt = {})
+{
+    vector<string> got;
+    Tcp::WriteLog log(dir, opt);
+    log.replay([&got](string_view msg, Tcp::Encoding) { got.emplace_back(msg); });
+    return got;
+}
+
+// overwrite bytes of the file at path
+static void damage(const string &path, off_t at, const string &bytes)
+{
+    int fd = open(path.c_str(), O_WRONLY);
+    check(fd >= 0 && pwrite(fd, bytes.data(), bytes.size(), at) == ssize_t(bytes.size()), "damage " + path);
+    close(fd);
+}
+
+static bool inOrder(const vector<string> &got, int n)
+{
+    if (int(got.size()) != n) {
+        return false;
+    }
+    for (int k = 0; k < n; k++) {
+        if (got[k] != message(k)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testReopen()
+{
+    string dir = directory("reopen");
+    fill(dir, 100);
+    check(inOrder(replay(dir), 100), "reopened log replays every record in order");
+    system(("rm -rf " + dir).c_str());
+}
+
+// a crash in the middle of a record leaves it half written
+static void testTornTail()
+{
+    string dir = directory("torn");
+    fill(dir, 10);
+    damage(segments(dir).back(), 9 * RECORD + RECORD / 2, string(RECORD / 2, '\0'));
+    check(inOrder(replay(dir), 9), "replay stops before a torn last record");
+
+    // the next append takes the place of the torn record
+    {
+        Tcp::WriteLog log(dir);
+        log.replay([](string_view, Tcp::Encoding) {});
+        log.sync(log.append("a", Tcp::Encoding::Json, message(9)));
+    }
+    check(inOrder(replay(dir), 10), "an append after a torn record replays after the intact ones");
+    system(("rm -rf " + dir).c_str());
+}
+
+static void testCrc()
+{
+    string dir = directory("crc");
+    fill(dir, 10);
+    // one bit of the message of the fifth record
+    int fd = open(segments(dir).back().c_str(), O_RDWR);
+    char b = 0;
+    off_t at = 4 * RECORD + 24 + 1 + 3;
+    check(pread(fd, &b, 1, at) == 1, "read record byte");
+    b ^= 1;
+    check(pwrite(fd, &b, 1, at) == 1, "flip record bit");
+    close(fd);
+    check(inOrder(replay(dir), 4), "replay stops at a record whose crc does not match");
+    system(("rm -rf " + dir).c_str());
+}
+
+// small segments fill up and the log goes on in new files
+static void testRoll()
+{
+    string dir = directory("roll");
+    Tcp::WalOptions opt{.segment = 4096, .window = 0, .keep = 100};
+    fill(dir, 300, opt);
+    size_t files = segments(dir).size(), per = 4096 / RECORD;
+    check(files == (300 + per - 1) / per, "300 records roll over " + to_string(files) + " segments");
+    check(inOrder(replay(dir, opt), 300), "replay goes through every segment in order");
+
+    // damage in an older segment ends the log there, the later segments are not replayed
+    damage(segments(dir)[1], 3 * RECORD + 8, "xxxx");
+    auto got = replay(dir, opt);
+    check(inOrder(got, per + 3), "replay stops at a damaged record of a full segment, " + to_string(got.size()) + " replayed");
+    system(("rm -rf " + dir).c_str());
+}
+
+// full segments are folded into one with the newest write of every topic
+static void testCompaction()
+{
+    string dir = directory("compact");
+    Tcp::WalOptions opt{.segment = 4096, .window = 0, .keep = 2};
+    int n = 500, topics = 5;
+    fill(dir, n, opt, topics);
+    check(segments(dir).size() <= 4, "compaction keeps few segments, " + to_string(segments(dir).size()) + " left");
+
+    auto got = replay(dir, opt);
+    map<char, int> last;
+    bool ascending = true;
+    int prev = -1;
+    for (auto &m : got) {
+        int k = atoi(m.c_str() + 6);
+        ascending = ascending && k > prev;
+        prev = k;
+        last[char('a' + k % topics)] = k;
+    }
+    check(got.size() < size_t(n), "compaction dropped the older writes, " + to_string(got.size()) + " replayed");
+    check(ascending, "compacted records replay in log order");
+    bool newest = int(last.size()) == topics;
+    for (auto &[key, k] : last) {
+        newest = newest && k >= n - topics;
+    }
+    check(newest, "the newest write of every topic is kept");
+    system(("rm -rf " + dir).c_str());
+}
+
+int main()
+{
+    testReopen();
+    testTornTail();
+    testCrc();
+    testRoll();
+    testCompaction();
+    cout << (failures ? to_string(failures) + " failed" : "all passed") << endl;
+    return failures ? 1 : 0;
+}